@@ -0,0 +1,69 @@
+#pragma once
+#include <vector>
+#include <string>
+#include "network/network_io.hpp"
+
+/*
+	Adaptive bitrate selection between the video qualities of one video
+	The bandwidth estimate is the smaller of a fast and a slow moving average of the throughput the downloader achieved,
+	so that drops are followed quickly and spikes are not. A quality is picked if its bitrate fits in a fraction of
+	the estimate that grows with the buffer level, and the buffer level alone decides in the extremes :
+	a nearly empty buffer falls back to the lowest quality and switching up waits until enough has been buffered.
+	A switch reopens the streams and so empties the buffer : an empty buffer only forces the lowest quality once the
+	switch is PANIC_HOLD_OFF old and only while it is not refilling, and switching down needs the current quality to
+	exceed what the estimate sustains even with a full buffer, so that a switch up is not undone by its own refill.
+	The controller only decides; the caller applies a decision at the next keyframe.
+	Nothing here depends on the platform, all times are passed in by the caller (microseconds).
+*/
+
+// bits per second of a googlevideo url from its `clen` and `dur` parameters, 0 if they are missing
+uint64_t network_abr_get_bitrate(const std::string &url);
+
+class NetworkAbrController {
+private :
+	static constexpr double FAST_HALF_LIFE = 3.0; // seconds of transfer
+	static constexpr double SLOW_HALF_LIFE = 8.0;
+	static constexpr uint64_t MIN_ESTIMATE_BYTES = 256 * 1024; // the estimate is not used until this much has been measured
+	static constexpr double PANIC_BUFFER = 4.0; // seconds
+	static constexpr double MIN_UP_SWITCH_BUFFER = 15.0;
+	static constexpr double MIN_SAFETY = 0.7; // fraction of the estimate usable with an empty buffer
+	static constexpr double MAX_SAFETY = 0.9; // with a buffer of MIN_UP_SWITCH_BUFFER or more
+	static constexpr SceUInt64 MIN_SWITCH_INTERVAL = 10 * 1000 * 1000; // between two switches, except for panic switches
+	static constexpr SceUInt64 PANIC_HOLD_OFF = 8 * 1000 * 1000; // after a switch, during which an empty buffer alone does not force the lowest quality
+
+	struct Quality {
+		int p_value;
+		uint64_t bitrate; // bits per second, 0 if unknown
+	};
+	std::vector<Quality> qualities; // in increasing order of p_value
+	int max_p_value = -1; // the highest quality allowed, -1 : no limit
+
+	double fast_estimate = 0; // bytes per second
+	double slow_estimate = 0;
+	double fast_weight = 0; // how much of the averages is actual data, to correct for their zero initial values
+	double slow_weight = 0;
+	uint64_t measured_bytes = 0;
+
+	uint64_t last_total_bytes = 0;
+	SceUInt64 last_total_time = 0;
+	SceUInt64 last_switch_time = 0;
+	bool switched = false;
+	double last_buffer_seconds = -1; // at the previous select()
+
+	uint64_t get_bitrate(int p_value);
+public :
+	// `qualities` : pairs of (p value, url), as in YouTubeVideoDetail::video_stream_urls
+	void set_qualities(const std::vector<std::pair<int, std::string> > &qualities);
+	void set_max_quality(int p_value) { max_p_value = p_value; }
+	void reset_estimate();
+
+	// `total_bytes` and `total_time` are running totals of the data transferred and the time spent transferring it
+	// (see NetworkStreamDownloader::get_transfer_totals()), only their increments since the previous call are used
+	void add_transfer_totals(uint64_t total_bytes, SceUInt64 total_time);
+	void add_sample(uint64_t bytes, SceUInt64 duration);
+	// bytes per second, 0 if not enough has been measured
+	uint64_t get_estimate();
+
+	// the quality to play given the current one, the seconds of media buffered ahead of the playhead (-1 if unknown) and the current time
+	int select(int cur_p_value, double buffer_seconds, SceUInt64 now);
+};
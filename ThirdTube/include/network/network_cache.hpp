@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <map>
+#include "network/network_io.hpp"
+
+/*
+	HTTP response cache used by Access_http_get()
+	Responses are stored together with their validators (ETag, Last-Modified) and a freshness lifetime taken from
+	Cache-Control: max-age, Expires, or (if neither is present) a tenth of the time since Last-Modified, capped at a day.
+	Fresh entries are answered locally, stale ones are revalidated with If-None-Match/If-Modified-Since.
+	Recently used entries are kept in memory, everything is also written under NETWORK_CACHE_DIR, both tiers are LRU within their quota.
+	The disk tier is off until network_cache_set_quota() gives it a quota.
+	Requests with a Range header and responses with Cache-Control: no-store are never cached.
+*/
+
+#define NETWORK_CACHE_DIR "savedata0:yt_http_cache/"
+
+// 0 disables the corresponding tier, both 0 disables the cache (by default : 2 MiB of memory, no disk)
+PRX_EXPORT void network_cache_set_quota(SceSize memory_quota, SceSize disk_quota);
+// drops every entry in both tiers
+PRX_EXPORT void network_cache_clear();
+
+// used by network_io.cpp
+// returns true and fills `res` if a fresh response is cached
+// otherwise adds the validators of a stale entry (if any) to `conditional_headers`
+bool network_cache_lookup(const std::string &url, const std::map<std::string, std::string> &request_headers, NetworkResult &res,
+	std::map<std::string, std::string> &conditional_headers);
+// called with the response to the (possibly conditional) request
+// a 304 is replaced with the cached response, other cacheable responses are stored
+// returns false for a 304 whose entry was evicted meanwhile, the request should then be repeated without the conditional headers
+bool network_cache_update(const std::string &url, const std::map<std::string, std::string> &request_headers, NetworkResult &res);
@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <map>
+#include "network/network_io.hpp"
+
+/*
+	Record/replay of HTTP traffic
+	In capture mode, every request made through access_http_internal() is appended to an archive file
+	together with its response and how long it took.
+	In replay mode, requests are answered from a previously captured archive without touching the network.
+	Identical requests (same method, url, Range header and body) are answered in the order they were captured.
+*/
+
+enum class NetworkCaptureMode {
+	OFF,
+	CAPTURE,
+	REPLAY
+};
+
+// starts appending requests and responses to `path` (the file is truncated)
+bool network_capture_start(const std::string &path);
+// loads `path` and starts answering requests from it
+// if `original_timing` is true, each replayed response is delayed by the time the original request took
+bool network_replay_start(const std::string &path, bool original_timing);
+// stops both capturing and replaying
+PRX_EXPORT void network_capture_stop();
+NetworkCaptureMode network_capture_get_mode();
+
+// used by network_io.cpp
+bool network_replay_lookup(const std::string &method, const std::string &url, const std::map<std::string, std::string> &request_headers,
+	const std::string &body, NetworkResult &res);
+void network_capture_record(const std::string &method, const std::string &url, const std::map<std::string, std::string> &request_headers,
+	const std::string &body, const NetworkResult &res, SceUInt64 start_time, SceUInt64 duration);
@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "network/network_io.hpp"
+
+/*
+	Offline downloads of media streams
+	Each stream of a download (e.g. the video and the audio itag of one video) is saved to
+	<path><video id>/<itag>_<clen>.part with range requests of the BACKGROUND traffic class, and renamed to .bin once complete.
+	The file size of a .part file is the resume point : a download started again for the same video and itags (with freshly
+	parsed urls, the old ones expire) continues from there, also after a restart.
+	NetworkStream reads completed streams from the disk instead of the network (see network_download_get_local_path()).
+	Downloads run one at a time on a worker thread, optionally limited to a rate on top of the scheduler's share.
+*/
+
+#define NETWORK_DOWNLOAD_DEFAULT_PATH "ux0:data/ThirdTube/downloads/"
+
+enum class NetworkDownloadState {
+	QUEUED,
+	DOWNLOADING,
+	PAUSED,
+	DONE,
+	ERROR
+};
+
+// `path` must end with '/'
+void network_download_set_path(const std::string &path);
+// bytes per second, 0 : no limit other than the scheduler's
+PRX_EXPORT void network_download_set_rate_limit(unsigned int bytes_per_second);
+
+// queues a download of all `urls` (resuming any partially downloaded stream), returns its id
+int network_download_start(const std::vector<std::string> &urls);
+// stops the download, its partial files are kept for a later network_download_start()
+PRX_EXPORT void network_download_pause(int id);
+// stops the download and removes its files
+PRX_EXPORT void network_download_cancel(int id);
+// returns false if there is no such download
+PRX_EXPORT bool network_download_get_progress(int id, unsigned long long *downloaded, unsigned long long *total, NetworkDownloadState *state);
+
+// the completed download of the stream of `url` (same video id, itag and length), "" if there is none
+std::string network_download_get_local_path(const std::string &url);
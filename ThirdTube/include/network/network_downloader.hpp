@@ -2,76 +2,195 @@
 #include <vector>
 #include <map>
 #include <string>
-#include <3ds.h>
 #include "network/network_io.hpp"
 
+// AVERROR_EOF and AVERROR(EIO) of FFmpeg, so that network_stream_avio_read() can be handed to avio_alloc_context() as is
+#define NETWORK_STREAM_AVERROR_EOF (-0x20464F45)
+#define NETWORK_STREAM_AVERROR_EIO (-5)
+
+// a downloaded block, immutable once published to NetworkStream::blocks
+// readers pin it so that eviction cannot free it while they copy out of it
+struct NetworkStreamBlock {
+	std::vector<uint8_t> data;
+	int ref_count = 1; // the reference held by NetworkStream::blocks, guarded by NetworkStream::downloaded_data_lock
+};
+
 // one instance per one url (once constructed, the url is not changeable)
 struct NetworkStream {
-	static constexpr u64 BLOCK_SIZE = 0x40000; // 256 KiB
-	static constexpr u64 MAX_CACHE_BLOCKS = 12 * 1000 * 1000 / BLOCK_SIZE;
+	static constexpr uint64_t BLOCK_SIZE = 0x40000; // 256 KiB
+	static constexpr uint64_t MAX_CACHE_BLOCKS = 12 * 1000 * 1000 / BLOCK_SIZE; // budget until the downloader assigns one
+	static constexpr uint64_t MAX_FIRST_REQUEST_BLOCKS = 4;
 	
-	u64 block_num = 0;
+	uint64_t block_num = 0;
 	std::string url;
-	Handle downloaded_data_lock; // std::map needs locking when searching and inserting at the same time
-	std::map<u64, std::vector<u8> > downloaded_data;
+	NetworkMutex downloaded_data_lock; // guards `blocks`, `cached_block_num` and the reference counts
+	std::vector<NetworkStreamBlock *> blocks; // indexed by block number, NULL if not downloaded
+	uint64_t cached_block_num = 0;
+	// cache budget in blocks on each side of the read head, assigned by NetworkStreamDownloader
+	uint64_t max_ahead_blocks = MAX_CACHE_BLOCKS * 3 / 4;
+	uint64_t max_behind_blocks = MAX_CACHE_BLOCKS / 4;
+	uint64_t readahead_blocks = 0; // how far ahead of the read head the downloader fetches
+	// (byte offset, presentation time in seconds) pairs in increasing order, e.g. from the segment index of the stream
+	// if empty, time is assumed to be linear in the byte offset over `duration`
+	std::vector<std::pair<uint64_t, double> > time_map;
 	bool whole_download = false;
-	NetworkSessionList *session_list = NULL;
+	// bytes at the beginning holding the initialization data and the segment index, fetched in the first request
+	// taken from network_stream_set_header_size() when the stream is created, 0 if unknown
+	uint64_t header_size = 0;
+	bool prefetch = false; // requested ahead of need (e.g. a livestream fragment after the next one), fetched with a lower priority
+	// where evicted blocks go in the disk tier (network_spill.hpp), derived from the url unless set by the player
+	std::string spill_group;
+	std::string spill_key;
+	// a completed offline download of the stream (network_download.hpp) : blocks are read from there instead of the network
+	std::string local_path;
 	
 	// anything above here is not supposed to be used from outside network_downloader.cpp and network_downloader.hpp
-	u64 len = 0;
+	uint64_t len = 0;
 	volatile bool ready = false;
 	volatile bool suspend_request = false;
 	volatile bool quit_request = false;
 	volatile bool error = false;
-	volatile u64 read_head = 0;
+	volatile uint64_t read_head = 0;
+	volatile double duration = 0; // seconds, from the `dur` parameter of the url (0 if unknown); used to derive the bitrate and the timing
+	volatile double playback_position = -1; // seconds, set by the decoder; -1 : estimated from read_head
 	const char * volatile network_waiting_status = NULL;
 	bool disable_interrupt = false;
 	// used for livestreams
 	int seq_head = -1;
 	int seq_id = -1;
+	double head_time = -1; // media time of fragment `seq_head` in seconds, -1 if unknown
 	bool livestream_eof = false;
 	bool livestream_private = false;
 	
 	// if `whole_download` is true, it will not use Range request but download the whole content at once (used for livestreams)
-	NetworkStream (std::string url, bool whole_download, NetworkSessionList *session_list);
+	NetworkStream (std::string url, bool whole_download);
+	~NetworkStream ();
 	
 	double get_download_percentage();
 	std::vector<double> get_buffering_progress_bar(int res_len);
 	
 	// check if the data of the current stream of range [start, start + size) is already downloaded and available
-	bool is_data_available(u64 start, u64 size);
+	bool is_data_available(uint64_t start, uint64_t size);
 	
 	// this function must only be called when is_data_available(start, size) returns true
 	// returns the data of the stream of range [start, start + size)
-	std::vector<u8> get_data(u64 start, u64 size);
+	std::vector<uint8_t> get_data(uint64_t start, uint64_t size);
+	
+	// copies as much of [start, start + size) as is available contiguously from `start` into `dst`, without any intermediate buffer
+	// returns the number of bytes copied, 0 if the block containing `start` is not downloaded yet, -1 if `start` is at or past the end
+	// (a block shorter than it should be sets `error`)
+	int read_into(uint64_t start, uint8_t *dst, int size);
+	
+	// the number of bytes the first request fetches : the whole header (see header_size) in block units, at least one block
+	static uint64_t get_first_request_size(uint64_t header_size);
 	
-	// this function is supposed to be called from NetworkStreamDownloader::*
-	void set_data(u64 block, const std::vector<u8> &data);
+	// bytes per second of playback, 0 if unknown
+	uint64_t get_byte_rate();
+	void set_time_map(std::vector<std::pair<uint64_t, double> > &&time_map);
+	// presentation time of the byte at `offset`, -1 if unknown
+	double get_time_of(uint64_t offset);
+	// seconds of media downloaded contiguously ahead of the read head, -1 if the timing of the stream is unknown
+	double get_buffered_seconds();
+	
+	// these functions are supposed to be called from NetworkStreamDownloader::*
+	void set_block_num(uint64_t block_num);
+	void set_cache_budget(uint64_t ahead_blocks, uint64_t behind_blocks);
+	// `data` is taken over (moved) by the stream
+	// returns false (and keeps nothing) if its size is not that of the block : min(BLOCK_SIZE, len - block * BLOCK_SIZE)
+	bool set_data(uint64_t block, std::vector<uint8_t> &&data);
+	// returns the block with an extra reference, or NULL
+	NetworkStreamBlock *pin_block(uint64_t block);
+	void unpin_block(NetworkStreamBlock *block);
+private :
+	void release_block(NetworkStreamBlock *block); // must be called with downloaded_data_lock held
+	void evict(); // must be called with downloaded_data_lock held
+	void drop_block(uint64_t block); // must be called with downloaded_data_lock held
 };
 
+// requests the first block of `url` in the background, so that a NetworkStream of the same url created shortly afterwards
+// starts with it instead of waiting for the request (used while the video page is still being parsed)
+// only the most recent few prefetches are kept, and unused ones expire after a while
+// `header_size` : see NetworkStream::header_size; the stream takes the prefetch if it is at least as large as its own first request
+void network_stream_prefetch_first_block(const std::string &url, uint64_t header_size = 0);
+
+// remembers the header size (see NetworkStream::header_size) of the stream of `url` for the NetworkStreams created later
+// (set by the parser for every format it finds, only the most recent ones are kept)
+void network_stream_set_header_size(const std::string &url, uint64_t header_size);
+
+// AVIO read callback : `opaque` is the NetworkStream, reads at and advances its read_head
+// blocks (with network_waiting_status set) until the data is downloaded, the stream fails or quit_request is made
+int network_stream_avio_read(void *opaque, uint8_t *buf, int buf_size);
+
 
 // each instance of this class is paired with one downloader thread
-// it owns NetworkStream instances, and the one with the least margin (as in proportion to the length of the entire stream) is the target of next downloading
+// it owns NetworkStream instances and fetches their missing blocks earliest-deadline-first across all streams,
+// the deadline of a block being the time until playback reaches it (see NetworkStream::get_time_of() and playback_position)
+// all streams share one memory budget, split in proportion to their bitrates and, within a stream, between the data behind and ahead of the read head
+// how far ahead each stream reads grows as the bitrate of all streams approaches the measured bandwidth
+// the blocks right after the read head of the target are fetched over several connections at once, the number of which
+// is adjusted by comparing the throughput achieved with neighbouring connection counts
+// streams that have just been added (e.g. consecutive livestream fragments) are started over the same number of connections, in the order they were added
 class NetworkStreamDownloader {
 private :
-	static constexpr u64 BLOCK_SIZE = NetworkStream::BLOCK_SIZE;
-	static constexpr u64 MAX_FORWARD_READ_BLOCKS = 50;
-	static constexpr const char * USER_AGENT = "Mozilla/5.0 (Linux; Android 11; Pixel 3a) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/83.0.4103.101 Mobile Safari/537.36";
+	static constexpr uint64_t BLOCK_SIZE = NetworkStream::BLOCK_SIZE;
+	static constexpr uint64_t MAX_FORWARD_READ_BLOCKS = 50; // readahead of streams whose bitrate is unknown
+	static constexpr uint64_t DEFAULT_MEMORY_BUDGET = 24 * 1000 * 1000;
+	static constexpr uint64_t MIN_STREAM_BLOCKS = 4;
+	static constexpr int MIN_READAHEAD_SECONDS = 8;
+	static constexpr int MAX_READAHEAD_SECONDS = 120;
+	static constexpr int MAX_CONNECTIONS = 4;
+	// first requests of new streams (e.g. the video and the audio, or livestream fragments) run in parallel up to this many,
+	// independently of connection_num (which is measured on block batches) : the PLAYBACK concurrency limit of the scheduler
+	static constexpr int MAX_PARALLEL_FIRST_BLOCKS = 4;
+	static constexpr int REPROBE_INTERVAL = 16; // batches between retries of a connection count that did not pay off
+	static constexpr uint64_t DEFAULT_BYTE_RATE = 128 * 1000; // assumed for deadlines of streams whose duration is unknown
 	
-	Handle streams_lock;
+	struct BlockRequest {
+		NetworkStream *stream;
+		uint64_t block;
+		double deadline; // seconds from now
+	};
+
+	NetworkMutex streams_lock;
 	std::vector<NetworkStream *> streams;
+
+	// adaptive connection count
+	int connection_num = 1;
+	uint64_t throughput[MAX_CONNECTIONS + 1] = {0}; // bytes per second measured with each connection count, 0 : not measured yet
+	int batch_count = 0;
 	
-	bool thread_exit_reqeusted = false;
+	uint64_t memory_budget = DEFAULT_MEMORY_BUDGET;
+	// running totals of the blocks downloaded by fetch_blocks() and the time the batches took
+	volatile uint64_t transferred_bytes = 0;
+	volatile SceUInt64 transfer_time = 0;
+
+	volatile bool thread_exit_reqeusted = false;
+	bool thread_running = false; // guarded by streams_lock
+
+	static void fetch_first_block(NetworkStream *stream);
+	static SceInt32 first_block_fetch_thread(SceSize args, void *argp);
+	void fetch_first_blocks(const std::vector<NetworkStream *> &new_streams);
+	void fetch_blocks(const std::vector<BlockRequest> &requests);
+	double get_deadline(NetworkStream *stream, uint64_t block);
+	void update_connection_num(int used_connections, uint64_t bytes, SceUInt64 duration);
+	void update_budgets(); // must be called with streams_lock held
 public :
 	NetworkStreamDownloader ();
-	
+
 	// the pointer must be one that has been new-ed : it will be deleted once quit_request is made
 	void add_stream(NetworkStream *stream);
-	
+	// bytes of downloaded data kept in memory across all streams
+	void set_memory_budget(uint64_t bytes) { memory_budget = bytes; }
+	// for bandwidth estimation (see network_abr.hpp); the two values may be from different batches if read during an update
+	void get_transfer_totals(uint64_t *bytes, SceUInt64 *time) { *bytes = transferred_bytes; *time = transfer_time; }
+	// the smallest get_buffered_seconds() among the streams in playback, -1 if unknown
+	double get_buffered_seconds();
+
 	void request_thread_exit() { thread_exit_reqeusted = true; }
+	// deletes every stream, right away if the downloader thread is not running, otherwise by the thread (as with quit_request)
 	void delete_all();
-	
+
 	void downloader_thread();
 };
-// 'arg' should be a pointer to an instance of NetworkStreamDownloader
-void network_downloader_thread(void *arg);
+// thread entry for sceKernelCreateThread(), the argument block should be a pointer to an instance of NetworkStreamDownloader
+SceInt32 network_downloader_thread(SceSize args, void *argp);
@@ -0,0 +1,145 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <string>
+#include "network/network_downloader.hpp"
+
+/*
+	Prefetching of livestream (and DVR) fragments
+	Keeps the fragments after the one being played requested from a NetworkStreamDownloader, so that the next fragment
+	is already downloaded (and can be opened) when playback reaches it.
+	How many fragments are kept ahead follows the measured time from requesting a fragment until it is downloaded,
+	relative to the fragment length, and never goes past the latest fragment the server has announced.
+	The fragment right after the playhead is fetched with playback priority, the ones after it as prefetch traffic.
+*/
+
+/*
+	Index of the fragments of a livestream : sequence number -> start time and duration
+	Learned from the fragments themselves (the 'tfdt' decode time of their first 'moof', scaled by the 'mdhd' timescale)
+	and from the X-Head-Seqnum/X-Head-Time-Millis headers every fragment response carries about the latest fragment.
+	Durations come from the difference between the start times of consecutive fragments; fragments that have not been
+	seen are estimated from the nearest known one and the average duration, so that a seek lands on the right fragment
+	(or one next to it) without probing.
+*/
+class NetworkSegmentIndex {
+private :
+	struct Segment {
+		double start_time;
+		double duration; // 0 if unknown
+	};
+	NetworkMutex lock;
+	std::map<int, Segment> segments;
+	double default_duration = 0; // the nominal fragment length until an average of actual durations is known
+	double duration_sum = 0;
+	int duration_num = 0;
+	int seq_head = -1;
+	
+	void add(int seq, double start_time); // must be called with `lock` held
+	double get_average_duration(); // must be called with `lock` held
+	double estimate_start_time(int seq); // must be called with `lock` held
+public :
+	NetworkSegmentIndex () : lock("segment_index_lock") {}
+	
+	void reset(double fragment_len);
+	// learns from the response headers and the data of a downloaded fragment
+	void learn(int seq, NetworkStream *stream);
+	
+	int get_seq_head() { return seq_head; }
+	// start time of fragment `seq`, estimated if it has not been seen, -1 if nothing is known
+	double get_start_time(int seq);
+	// the end of the latest fragment, -1 if nothing is known
+	double get_end_time();
+	// the fragment that contains `time` (binary search over the known fragments, then estimation within the gap), -1 if nothing is known
+	int find(double time);
+};
+
+class NetworkFragmentPrefetcher {
+private :
+	static constexpr int MAX_PREFETCH_FRAGMENTS = 6;
+	static constexpr double FETCH_TIME_MARGIN = 1.5; // fetch time is multiplied by this before being compared with the fragment length
+
+	struct Fragment {
+		std::vector<NetworkStream *> streams; // one per url, in the order of `urls`, NULL once taken
+		SceUInt64 request_time = 0;
+		bool measured = false;
+	};
+
+	NetworkMutex lock;
+	NetworkStreamDownloader *downloader = NULL;
+	std::vector<std::string> urls; // the urls of one fragment without the sequence number : video and audio, or the muxed one
+	double fragment_len = 0; // seconds
+	std::map<int, Fragment> fragments; // sequence number -> fragment, the ones requested and not yet taken
+	double fetch_time = 0; // moving average in seconds, 0 : not measured yet
+	int seq_head = -1; // the latest sequence number available on the server, -1 : unknown
+	int seq_using = -1;
+	NetworkSegmentIndex segment_index;
+
+	void request(int seq, bool prefetch); // must be called with `lock` held
+	void release(Fragment &fragment); // must be called with `lock` held
+	void update_measurements(); // must be called with `lock` held
+public :
+	NetworkFragmentPrefetcher () : lock("fragment_prefetch_lock") {}
+	~NetworkFragmentPrefetcher () { deinit(); }
+
+	void init(NetworkStreamDownloader &downloader, const std::vector<std::string> &urls, double fragment_len);
+	// releases every fragment not taken yet
+	void deinit();
+
+	// the playhead is now in fragment `seq` : fragments before it are released and the ones after it requested
+	void update(int seq);
+	// hands over the streams of fragment `seq` (requesting them now if they were not prefetched), in the order of the urls
+	// the caller owns them from now on in the usual way : setting quit_request makes the downloader delete them
+	std::vector<NetworkStream *> take(int seq);
+	// same as above for only the stream of `urls[url_index]`
+	NetworkStream *take(int seq, int url_index);
+
+	int get_prefetch_num();
+	int get_seq_head() { return seq_head; }
+	double get_fetch_time() { return fetch_time; }
+	NetworkSegmentIndex &get_segment_index() { return segment_index; }
+};
+
+/*
+	One media stream of consecutive fragments read as a single continuous byte stream, so that one demuxer
+	(and one set of codec contexts) can be kept open for the whole livestream instead of one per fragment.
+	Every fragment is self-initializing : the leading 'ftyp' and 'moov' boxes of all fragments but the first are skipped,
+	which leaves a regular fragmented MP4 (one 'moov' followed by 'moof'/'mdat' pairs) for the demuxer.
+	The position of each fragment boundary in the continuous stream is recorded, so that timestamps can be rebased
+	per fragment if needed (see get_seq_at()).
+*/
+class NetworkFragmentSource {
+private :
+	static constexpr int MAX_FRAGMENT_RETRY = 10; // a fragment that keeps failing is taken as the end of the livestream (read() returns EOF)
+	static constexpr SceUInt64 RETRY_INTERVAL = 500 * 1000; // us
+
+	NetworkFragmentPrefetcher *prefetcher = NULL;
+	int url_index = 0;
+	NetworkStream *cur_stream = NULL;
+	int cur_seq = -1;
+	uint64_t read_pos = 0; // position in the continuous stream
+	NetworkMutex boundaries_lock;
+	std::vector<std::pair<uint64_t, int> > boundaries; // (offset in the continuous stream, sequence number) of each fragment
+
+	bool open_fragment(int seq);
+	bool skip_headers(NetworkStream *stream);
+public :
+	volatile bool quit_request = false;
+
+	NetworkFragmentSource () : boundaries_lock("fragment_boundaries_lock") {}
+	~NetworkFragmentSource () { deinit(); }
+
+	// `url_index` selects the stream among the urls of `prefetcher`
+	void init(NetworkFragmentPrefetcher &prefetcher, int url_index, int first_seq);
+	void deinit();
+
+	// same return values as network_stream_avio_read(), returns EOF soon after quit_request is set from another thread
+	int read(uint8_t *buf, int buf_size);
+
+	// the fragment containing `offset` of the continuous stream, -1 if none
+	int get_seq_at(uint64_t offset);
+	int get_cur_seq() { return cur_seq; }
+	uint64_t get_read_pos() { return read_pos; }
+	const char *get_network_waiting_status() { return cur_stream ? cur_stream->network_waiting_status : NULL; }
+};
+// AVIO read callback : `opaque` is the NetworkFragmentSource
+int network_fragment_avio_read(void *opaque, uint8_t *buf, int buf_size);
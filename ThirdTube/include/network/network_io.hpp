@@ -2,13 +2,62 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <memory>
+#include <cstring>
 #include <kernel.h>
 #include <curl/curl.h>
 
+// same as in youtube_parser/parser.hpp, for functions of the network layer that are exported from the PRX
+#ifdef TT_PRX
+#define PRX_EXPORT __declspec(dllexport)
+#else
+#define PRX_EXPORT
+#endif
+
 #define NETWORK_FRAMEWORK_HTTPC 0
 #define NETWORK_FRAMEWORK_SSLC 1
 #define NETWORK_FRAMEWORK_LIBCURL 2
 
+/*
+	Per-request timing
+	libhttp performs name resolution, connection, TLS handshake and sending inside sceHttpSendRequest(),
+	so those are reported together as `send`; a short `send` usually means a kept-alive connection was reused.
+	All durations are in microseconds.
+*/
+struct NetworkTiming {
+	SceUInt64 queue = 0; // waiting for network_scheduler_acquire()
+	SceUInt64 setup = 0; // creating the connection and the request objects
+	SceUInt64 send = 0; // sceHttpSendRequest() : resolve + connect + TLS + request
+	SceUInt64 response = 0; // until the status line and the headers are available (time-to-first-byte after `send`)
+	SceUInt64 transfer = 0; // reading the body
+	SceUInt64 redirect = 0; // time spent on the previous hops of a redirect chain
+	SceUInt64 total = 0; // including `queue` and `redirect`
+	int redirect_count = 0;
+	SceUInt64 bytes_sent = 0;
+	SceUInt64 bytes_received = 0;
+};
+
+// traffic classes of network_scheduler.hpp, in order of priority
+enum class NetworkTrafficClass {
+	PLAYBACK, // media needed by the player right now
+	INTERACTIVE, // API calls and pages the user is waiting for
+	PREFETCH, // media or pages that may be needed later
+	THUMBNAIL,
+	BACKGROUND,
+	AUTO // infer from the url
+};
+#define NETWORK_TRAFFIC_CLASS_NUM 5
+
+// a header value inside NetworkResult::response_headers; only valid while the result is alive and unmodified
+struct NetworkHeaderView {
+	const char *data = NULL;
+	size_t size = 0;
+	bool found = false;
+	
+	bool equals(const char *str) const { return strlen(str) == size && !memcmp(data, str, size); }
+	std::string str() const { return found ? std::string(data, size) : ""; }
+};
+
 struct NetworkResult {
 
 	NetworkResult()
@@ -20,6 +69,11 @@ struct NetworkResult {
 	{
 		data.clear();
 	}
+	// the destructor above would otherwise suppress the move operations
+	NetworkResult(const NetworkResult &) = default;
+	NetworkResult(NetworkResult &&) = default;
+	NetworkResult &operator = (const NetworkResult &) = default;
+	NetworkResult &operator = (NetworkResult &&) = default;
 
 	std::string redirected_url;
 	bool fail = false; // receiving http error code like 404 is still counted as a 'success'
@@ -27,18 +81,40 @@ struct NetworkResult {
 	int status_code = -1;
 	std::string status_message;
 	std::vector<uint8_t> data;
-	std::map<std::string, std::string> response_headers;
-	char *responseHeaders;
-	SceSize responseHeadersLen;
-	SceInt32 templateId;
-	SceInt32 connectionId;
-	SceInt32 requestId;
+	std::string response_headers; // the raw header block, parsed once into header_index by set_response_headers()
+	struct HeaderSlot {
+		uint32_t hash = 0;
+		uint32_t key_pos = 0;
+		uint32_t key_len = 0; // 0 for empty slots
+		uint32_t value_pos = 0;
+		uint32_t value_len = 0;
+	};
+	std::vector<HeaderSlot> header_index; // open addressing over case-insensitive header names, size is a power of two
+	SceInt32 templateId = -1;
+	SceInt32 connectionId = -1;
+	SceInt32 requestId = -1;
+	NetworkTiming timing;
 	
 	bool status_code_is_success() { return status_code / 100 == 2; }
+	void set_response_headers(const char *headers, size_t len);
+	// the returned view points into this->response_headers
+	NetworkHeaderView get_header_view(const char *key) const;
 	std::string get_header(std::string key);
+	// false if the body is shorter or longer than its Content-Length (e.g. the connection was cut), true if there is no Content-Length
+	bool body_matches_content_length() const;
 	void finalize();
 };
 
+// lightweight mutex usable as a static object
+class NetworkMutex {
+	SceKernelLwMutexWork work;
+public :
+	NetworkMutex (const char *name) { sceKernelCreateLwMutex(&work, name, 0, 0, NULL); }
+	~NetworkMutex () { sceKernelDeleteLwMutex(&work); }
+	void lock() { sceKernelLockLwMutex(&work, 1, NULL); }
+	void unlock() { sceKernelUnlockLwMutex(&work, 1); }
+};
+
 struct NetworkSession {
 	bool inited = false;
 	bool fail = false;
@@ -49,14 +125,43 @@ struct NetworkSession {
 	void close();
 };
 
-NetworkResult Access_http_get(std::string url, const std::map<std::string, std::string> &request_headers, bool follow_redirect = true);
+struct InFlightRequest;
+struct RangeFetch;
+// lets another thread give up on a request in progress
+// identical GETs in progress at the same time share one transfer, which is aborted only once every caller sharing it has called abort()
+struct NetworkRequestControl {
+	volatile bool abort_request = false;
+	volatile SceInt32 request_id = -1; // the live libhttp request, if any
+	InFlightRequest *flight = NULL; // the shared transfer this caller is waiting for, if any
+	SceUID wake_event = -1; // set by abort() to stop waiting for `flight`
+	RangeFetch *range_fetch = NULL; // the Access_http_get_range() running under this control, if any
+	NetworkTrafficClass traffic_class = NetworkTrafficClass::AUTO;
+	bool coalesce = true; // false to always start a transfer of its own (hedged copies must not merge into the request they race)
+	// progress of the transfer, only updated for requests that are not coalesced
+	volatile SceUInt64 admit_time = 0; // when the scheduler let the request start, 0 while it is queued
+	volatile SceUInt64 bytes_received = 0;
+	volatile SceUInt64 last_progress_time = 0;
+	
+	void abort();
+};
+
+// identifies a GET : normalized url (lower-cased scheme and host, no fragment), request headers and redirect policy
+std::string network_get_request_key(const std::string &url, const std::map<std::string, std::string> &request_headers, bool follow_redirect);
+NetworkResult Access_http_get(std::string url, const std::map<std::string, std::string> &request_headers, bool follow_redirect = true,
+	NetworkRequestControl *control = NULL);
+// same as Access_http_get(), but the result is shared with the other callers of the same transfer instead of copied
+std::shared_ptr<const NetworkResult> Access_http_get_shared(const std::string &url, const std::map<std::string, std::string> &request_headers,
+	bool follow_redirect = true, NetworkRequestControl *control = NULL);
 NetworkResult Access_http_post(const std::string &url, const std::map<std::string, std::string> &request_headers,
-	const std::string &body);
+	const std::string &body, NetworkRequestControl *control = NULL);
 
 std::string url_get_host_name(const std::string &url);
+// the raw (not decoded) value of the query parameter `name`, "" if there is none
+std::string url_get_param(const std::string &url, const std::string &name);
 
 #define HTTP_STATUS_CODE_OK 200
 #define HTTP_STATUS_CODE_NO_CONTENT 204
 #define HTTP_STATUS_CODE_PARTIAL_CONTENT 206
 #define HTTP_STATUS_CODE_FORBIDDEN 403
 #define HTTP_STATUS_CODE_NOT_FOUND 404
+#define HTTP_STATUS_CODE_RANGE_NOT_SATISFIABLE 416
@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "network/network_io.hpp"
+
+/*
+	Livestream playback for the application
+	Each open livestream has a stream downloader (on a thread of its own), a fragment prefetcher and one continuous
+	fragment source per url (see network_fragment.hpp) : the video and the audio, or the muxed one.
+	The application reads each source like a single file and hands it to its demuxer, fragments are prefetched
+	ahead of the read position and the fragment index built while reading serves seeks by time.
+*/
+
+// `urls` : the fragment urls without the sequence number, `fragment_len` : the nominal fragment length in seconds
+// returns the id of the livestream, -1 on failure
+int network_livestream_open(const std::vector<std::string> &urls, double fragment_len, int first_seq);
+// stops the reads in progress (they return EOF) and releases everything
+PRX_EXPORT void network_livestream_close(int id);
+
+// reads the source of `urls[url_index]`, same return values as network_stream_avio_read()
+PRX_EXPORT int network_livestream_read(int id, int url_index, unsigned char *buf, int buf_size);
+// restarts every source at fragment `seq`, must not be called while a read of the livestream is in progress
+PRX_EXPORT bool network_livestream_seek(int id, int seq);
+
+// the fragment the source of `urls[url_index]` is reading, -1 if none (yet)
+PRX_EXPORT int network_livestream_get_cur_seq(int id, int url_index);
+// the latest fragment the server has announced, -1 if unknown
+PRX_EXPORT int network_livestream_get_seq_head(int id);
+// the fragment that contains `time` (seconds), -1 if nothing is known yet
+PRX_EXPORT int network_livestream_find(int id, double time);
+// the start time of fragment `seq` in seconds, -1 if nothing is known yet
+PRX_EXPORT double network_livestream_get_start_time(int id, int seq);
@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <map>
+#include "network/network_io.hpp"
+
+/*
+	Range fetches with stall detection, hedging and retries, intended for googlevideo media requests
+	Each attempt gets a progress deadline derived from the throughput and time-to-first-byte measured on earlier
+	range fetches to the same endpoint. When an attempt misses it, a duplicate (hedged) request is started and
+	whichever finishes first wins, the other one is aborted.
+	Failed attempts (network errors or 5xx) are retried with exponential backoff and jitter.
+*/
+
+#define NETWORK_RANGE_MAX_ATTEMPTS 4 // including hedged copies
+#define NETWORK_RANGE_MAX_PARALLEL 2
+
+// fetches bytes [start, end] (inclusive) of `url`
+// `control`, if given, aborts every attempt of this fetch
+NetworkResult Access_http_get_range(const std::string &url, SceUInt64 start, SceUInt64 end,
+	const std::map<std::string, std::string> &request_headers = {}, NetworkRequestControl *control = NULL);
+
+// used by NetworkRequestControl::abort()
+void network_range_abort(NetworkRequestControl *control);
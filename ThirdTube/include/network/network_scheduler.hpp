@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include "network/network_io.hpp"
+
+/*
+	Priority-aware admission and pacing shared by every request made through access_http_internal()
+	Each request belongs to a traffic class, either given through NetworkRequestControl::traffic_class or inferred from the url.
+	- admission : every class has its own concurrency limit, the lower classes (PREFETCH and below) may not take the last
+	  NETWORK_SCHEDULER_RESERVED_SLOTS connections, and no class is admitted while a higher one is waiting
+	- pacing : while several classes are transferring, each one but PLAYBACK is limited to its weighted share of the link capacity
+	  (a class alone on the link and PLAYBACK are never throttled); the capacity is the peak throughput of recent windows,
+	  so pacing itself cannot drag it down
+	- preemption : while playback is marked critical (the player is about to rebuffer), every other class stops reading until it is cleared
+*/
+
+#define NETWORK_SCHEDULER_MAX_CONNECTIONS 6
+#define NETWORK_SCHEDULER_RESERVED_SLOTS 2
+
+// NetworkTrafficClass is defined in network_io.hpp
+
+NetworkTrafficClass network_scheduler_classify(const std::string &url);
+
+// blocks until a request of the class may start, returns false if `abort_request` was set while waiting
+bool network_scheduler_acquire(NetworkTrafficClass traffic_class, const volatile bool *abort_request);
+void network_scheduler_release(NetworkTrafficClass traffic_class);
+// called after `bytes` have been read, sleeps as long as the class is over its share or preempted
+void network_scheduler_throttle(NetworkTrafficClass traffic_class, SceSize bytes, const volatile bool *abort_request);
+
+// set by the player while its buffer is nearly empty
+PRX_EXPORT void network_scheduler_set_playback_critical(bool critical);
@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "network/network_downloader.hpp"
+
+/*
+	Disk tier for NetworkStream blocks
+	Blocks evicted from memory are written to disk on a background thread and read back instead of being downloaded again
+	(seeking backward, replaying, switching back to a previous quality).
+	Files are grouped per video (<path><group>/<stream key>_<block>.blk) so that one video can be dropped at once,
+	the whole tier is kept within its quota by removing the least recently used blocks, and every block carries a
+	checksum that is verified when it is read back.
+	Disabled until network_spill_set_quota() is called with a non-zero quota.
+*/
+
+#define NETWORK_SPILL_DEFAULT_PATH "ux0:data/ThirdTube/stream_cache/"
+
+// `path` must end with '/'; entries under the previous path are left as they are
+void network_spill_set_path(const std::string &path);
+PRX_EXPORT void network_spill_set_quota(unsigned int quota);
+// drops every block of `group` (see NetworkStream::spill_group)
+void network_spill_remove_group(const std::string &group);
+PRX_EXPORT void network_spill_clear();
+PRX_EXPORT void network_spill_get_stats(unsigned int *hit_count, unsigned int *miss_count);
+
+// used by network_downloader.cpp
+bool network_spill_is_enabled();
+// the googlevideo `id` parameter identifies the video, `itag` and `clen` the stream
+std::string network_spill_get_default_group(const std::string &url);
+std::string network_spill_get_stream_key(const std::string &url);
+// takes over `block` (its only reference) and writes it asynchronously
+void network_spill_store(const std::string &group, const std::string &stream_key, uint64_t block_index, NetworkStreamBlock *block);
+bool network_spill_load(const std::string &group, const std::string &stream_key, uint64_t block_index, std::vector<uint8_t> &out);
@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+#include "network/network_io.hpp"
+
+// per-endpoint latency histograms built from NetworkResult::timing (see network_io.hpp)
+
+// "host/first-path-component", with googlevideo hosts merged into one endpoint
+std::string network_stats_get_endpoint(const std::string &url);
+// called once per logical request (after redirects are followed)
+void network_stats_record(const std::string &url, const NetworkTiming &timing, bool fail);
+
+PRX_EXPORT void network_stats_reset();
+std::string network_stats_to_string();
+bool network_stats_dump(const std::string &path);
@@ -19,3 +19,6 @@ Result_with_string Util_converter_bgr888_rotate_90_degree(u8* bgr888, u8** rotat
 Result_with_string Util_converter_bgr888_to_yuv420p(u8* bgr888, u8** yuv420p, int width, int height);
 
 Result_with_string Util_converter_y2r_yuv420p_to_bgr565(u8* yuv420p, u8** bgr565, int width, int height, bool texture_format);
+
+// same as above, but into `bgr565` (width * height * 2 bytes or more) owned by the caller instead of a malloc()ed buffer
+Result_with_string Util_converter_y2r_yuv420p_to_bgr565_buffer(u8* yuv420p, u8* bgr565, int width, int height, bool texture_format);
@@ -3,6 +3,7 @@
 
 void Util_speaker_init(int play_ch, int music_ch, int sample_rate);
 
+// `size` : bytes per channel, the samples are copied into a buffer of the pool
 Result_with_string Util_speaker_add_buffer(int play_ch, int music_ch, u8* buffer, int size, double pts);
 
 double Util_speaker_get_current_timestamp(int play_ch, int sample_rate);
@@ -0,0 +1,109 @@
+#include "network/network_abr.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
+
+uint64_t network_abr_get_bitrate(const std::string &url) {
+	std::string clen = url_get_param(url, "clen");
+	std::string dur = url_get_param(url, "dur");
+	if (!clen.size() || !dur.size() || !isdigit(clen[0]) || !isdigit(dur[0])) return 0;
+	double duration = strtod(dur.c_str(), NULL);
+	if (duration <= 0) return 0;
+	return strtoull(clen.c_str(), NULL, 10) * 8 / duration;
+}
+
+
+void NetworkAbrController::set_qualities(const std::vector<std::pair<int, std::string> > &qualities) {
+	this->qualities.clear();
+	for (auto &quality : qualities) this->qualities.push_back({quality.first, network_abr_get_bitrate(quality.second)});
+	std::sort(this->qualities.begin(), this->qualities.end(), [] (const Quality &a, const Quality &b) { return a.p_value < b.p_value; });
+	switched = false;
+	last_buffer_seconds = -1;
+}
+
+void NetworkAbrController::reset_estimate() {
+	fast_estimate = slow_estimate = 0;
+	fast_weight = slow_weight = 0;
+	measured_bytes = 0;
+}
+
+void NetworkAbrController::add_transfer_totals(uint64_t total_bytes, SceUInt64 total_time) {
+	// totals from a different downloader (or a reset one) : only take them as the new base
+	if (total_bytes >= last_total_bytes && total_time >= last_total_time) add_sample(total_bytes - last_total_bytes, total_time - last_total_time);
+	last_total_bytes = total_bytes;
+	last_total_time = total_time;
+}
+
+void NetworkAbrController::add_sample(uint64_t bytes, SceUInt64 duration) {
+	if (!bytes || !duration) return;
+	double seconds = duration / 1000000.0;
+	double cur_rate = bytes / seconds;
+	// longer samples weigh more, so that the half lives are in seconds of transfer rather than in samples
+	double fast_alpha = 1 - std::pow(0.5, seconds / FAST_HALF_LIFE);
+	double slow_alpha = 1 - std::pow(0.5, seconds / SLOW_HALF_LIFE);
+	fast_estimate += (cur_rate - fast_estimate) * fast_alpha;
+	slow_estimate += (cur_rate - slow_estimate) * slow_alpha;
+	fast_weight += (1 - fast_weight) * fast_alpha;
+	slow_weight += (1 - slow_weight) * slow_alpha;
+	measured_bytes += bytes;
+}
+
+uint64_t NetworkAbrController::get_estimate() {
+	if (measured_bytes < MIN_ESTIMATE_BYTES || !fast_weight || !slow_weight) return 0;
+	return std::min(fast_estimate / fast_weight, slow_estimate / slow_weight);
+}
+
+uint64_t NetworkAbrController::get_bitrate(int p_value) {
+	for (auto &quality : qualities) if (quality.p_value == p_value) return quality.bitrate;
+	return 0;
+}
+
+int NetworkAbrController::select(int cur_p_value, double buffer_seconds, SceUInt64 now) {
+	std::vector<int> candidates;
+	for (auto &quality : qualities) if (max_p_value == -1 || quality.p_value <= max_p_value) candidates.push_back(quality.p_value);
+	if (!candidates.size()) {
+		if (!qualities.size()) return cur_p_value;
+		candidates.push_back(qualities[0].p_value);
+	}
+	auto cur_itr = std::find(candidates.begin(), candidates.end(), cur_p_value);
+
+	int res = cur_p_value;
+	uint64_t estimate = get_estimate();
+	bool buffer_known = buffer_seconds >= 0;
+	// the buffer emptied by a switch is refilling
+	bool refilling = (switched && now - last_switch_time < PANIC_HOLD_OFF) || buffer_seconds > last_buffer_seconds;
+	last_buffer_seconds = buffer_seconds;
+	if (buffer_known && buffer_seconds < PANIC_BUFFER && !refilling) res = candidates[0];
+	else if (cur_itr == candidates.end()) { // not allowed (anymore) : the highest allowed one below it, or the lowest
+		res = candidates[0];
+		for (auto p_value : candidates) if (p_value < cur_p_value) res = p_value;
+	} else if (estimate) {
+		double buffer_ratio = buffer_known ? std::min(buffer_seconds / MIN_UP_SWITCH_BUFFER, 1.0) : 0;
+		double usable_bitrate = estimate * 8 * (MIN_SAFETY + (MAX_SAFETY - MIN_SAFETY) * buffer_ratio);
+		// qualities of unknown bitrate are never switched to
+		int target = candidates[0];
+		for (auto p_value : candidates) {
+			uint64_t bitrate = get_bitrate(p_value);
+			if (bitrate && bitrate <= usable_bitrate) target = p_value;
+		}
+		bool interval_passed = !switched || now - last_switch_time >= MIN_SWITCH_INTERVAL;
+		if (target > cur_p_value && buffer_known && buffer_seconds >= MIN_UP_SWITCH_BUFFER && interval_passed) {
+			// one step at a time, the estimate may have been measured on a link that was not fully used
+			for (auto itr = cur_itr + 1; itr != candidates.end(); itr++) if (get_bitrate(*itr)) {
+				res = *itr;
+				break;
+			}
+		} else if (target < cur_p_value && (!buffer_known || buffer_seconds < MIN_UP_SWITCH_BUFFER)) {
+			// the switch up was made with MAX_SAFETY, use the same to decide that the current quality is not sustainable
+			uint64_t cur_bitrate = get_bitrate(cur_p_value);
+			if (!cur_bitrate || cur_bitrate > estimate * 8 * MAX_SAFETY) res = target;
+		}
+	}
+	if (res != cur_p_value) {
+		switched = true;
+		last_switch_time = now;
+		last_buffer_seconds = 0; // the streams are reopened
+	}
+	return res;
+}
@@ -0,0 +1,387 @@
+#include "network/network_cache.hpp"
+#include <list>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <ctime>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+	disk entry layout (all integers little-endian)
+	"TTRC" u32 version, str key, str redirected_url, str etag, str last_modified, u64 fresh_until, str response_headers, str body
+	str : u32 length, followed by the raw bytes
+*/
+
+#define CACHE_MAGIC "TTRC"
+#define CACHE_VERSION 1
+#define HEURISTIC_LIFETIME_MAX (24 * 60 * 60)
+
+struct CacheEntry {
+	std::string key;
+	std::string redirected_url;
+	std::string etag;
+	std::string last_modified;
+	SceInt64 fresh_until = 0; // unix time, 0 : always revalidate
+	std::string response_headers;
+	std::vector<uint8_t> data;
+
+	size_t get_size() const { return key.size() + redirected_url.size() + etag.size() + last_modified.size() + response_headers.size() + data.size(); }
+};
+
+static NetworkMutex cache_lock("cache_lock");
+static SceSize memory_quota = 2 * 1024 * 1024;
+static SceSize disk_quota = 0; // the disk tier is opt-in (network_cache_set_quota()), its writes are synchronous
+
+// memory tier, most recently used first
+static std::list<CacheEntry> memory_entries;
+static std::map<std::string, std::list<CacheEntry>::iterator> memory_index;
+static SceSize memory_usage = 0;
+
+// disk tier, file names ordered by last use (most recent first)
+struct DiskEntry {
+	SceSize size;
+	std::list<std::string>::iterator lru_itr;
+};
+static bool disk_index_loaded = false;
+static std::list<std::string> disk_lru;
+static std::map<std::string, DiskEntry> disk_index;
+static SceSize disk_usage = 0;
+
+
+static std::string get_file_name(const std::string &key) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (auto c : key) {
+		hash ^= (uint8_t) c;
+		hash *= 0x100000001B3ULL;
+	}
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%016llx.dat", (unsigned long long) hash);
+	return buf;
+}
+
+// "Sun, 06 Nov 1994 08:49:37 GMT" -> unix time, -1 if invalid
+static SceInt64 parse_http_date(const std::string &str) {
+	static const char *month_names[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	int day, year, hour, minute, second;
+	char month_str[4] = {0};
+	if (sscanf(str.c_str(), "%*3s, %d %3s %d %d:%d:%d", &day, month_str, &year, &hour, &minute, &second) != 6) return -1;
+	int month = -1;
+	for (int i = 0; i < 12; i++) if (!strcmp(month_str, month_names[i])) month = i + 1;
+	if (month == -1) return -1;
+
+	// days since 1970-01-01 in the proleptic Gregorian calendar
+	year -= month <= 2;
+	SceInt64 era = (year >= 0 ? year : year - 399) / 400;
+	SceInt64 year_of_era = year - era * 400;
+	SceInt64 day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	SceInt64 day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+	SceInt64 days = era * 146097 + day_of_era - 719468;
+	return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+// freshness lifetime in seconds
+static SceInt64 get_lifetime(const NetworkResult &res, bool &no_store) {
+	no_store = false;
+	bool no_cache = false;
+	SceInt64 max_age = -1;
+	std::string cache_control = res.get_header_view("Cache-Control").str();
+	for (size_t head = 0; head < cache_control.size(); ) {
+		size_t end = cache_control.find(',', head);
+		if (end == std::string::npos) end = cache_control.size();
+		std::string directive;
+		for (size_t i = head; i < end; i++) if (cache_control[i] != ' ') directive.push_back(std::tolower(cache_control[i]));
+		if (directive == "no-store") no_store = true;
+		else if (directive == "no-cache") no_cache = true;
+		else if (directive.substr(0, 8) == "max-age=") max_age = atoll(directive.c_str() + 8);
+		head = end + 1;
+	}
+	if (no_store || no_cache) return 0;
+	if (max_age >= 0) return max_age;
+
+	// Expires and Last-Modified are compared against the server's Date so that the console clock being off does not matter
+	SceInt64 date = parse_http_date(res.get_header_view("Date").str());
+	if (date < 0) date = time(NULL);
+	std::string expires = res.get_header_view("Expires").str();
+	if (expires.size()) {
+		SceInt64 expires_time = parse_http_date(expires);
+		return expires_time > date ? expires_time - date : 0;
+	}
+	SceInt64 last_modified = parse_http_date(res.get_header_view("Last-Modified").str());
+	if (last_modified >= 0 && last_modified < date) return std::min<SceInt64>((date - last_modified) / 10, HEURISTIC_LIFETIME_MAX);
+	return 0;
+}
+
+
+static void append_u32(std::string &out, SceUInt32 value) {
+	for (int i = 0; i < 4; i++) out.push_back((char) (value >> (i * 8) & 0xFF));
+}
+static void append_u64(std::string &out, SceUInt64 value) {
+	for (int i = 0; i < 8; i++) out.push_back((char) (value >> (i * 8) & 0xFF));
+}
+static void append_str(std::string &out, const char *data, size_t size) {
+	append_u32(out, size);
+	out.append(data, size);
+}
+static void append_str(std::string &out, const std::string &str) { append_str(out, str.data(), str.size()); }
+
+static std::string serialize_entry(const CacheEntry &entry) {
+	std::string res = CACHE_MAGIC;
+	append_u32(res, CACHE_VERSION);
+	append_str(res, entry.key);
+	append_str(res, entry.redirected_url);
+	append_str(res, entry.etag);
+	append_str(res, entry.last_modified);
+	append_u64(res, entry.fresh_until);
+	append_str(res, entry.response_headers);
+	append_str(res, (const char *) entry.data.data(), entry.data.size());
+	return res;
+}
+static bool deserialize_entry(const std::string &buffer, CacheEntry &entry) {
+	size_t head = 0;
+	bool error = false;
+	auto read_int = [&] (int bytes) {
+		SceUInt64 res = 0;
+		if (head + bytes > buffer.size()) error = true;
+		else for (int i = 0; i < bytes; i++) res |= (SceUInt64) (uint8_t) buffer[head++] << (i * 8);
+		return res;
+	};
+	auto read_str = [&] () {
+		size_t size = read_int(4);
+		if (error || head + size > buffer.size()) {
+			error = true;
+			return std::string();
+		}
+		head += size;
+		return buffer.substr(head - size, size);
+	};
+	if (buffer.size() < 8 || memcmp(buffer.data(), CACHE_MAGIC, 4)) return false;
+	head = 4;
+	if (read_int(4) != CACHE_VERSION) return false;
+	entry.key = read_str();
+	entry.redirected_url = read_str();
+	entry.etag = read_str();
+	entry.last_modified = read_str();
+	entry.fresh_until = read_int(8);
+	entry.response_headers = read_str();
+	std::string body = read_str();
+	entry.data.assign(body.begin(), body.end());
+	return !error && head == buffer.size();
+}
+
+
+// the functions below must be called with cache_lock held
+
+static void memory_remove(const std::string &key) {
+	auto itr = memory_index.find(key);
+	if (itr == memory_index.end()) return;
+	memory_usage -= itr->second->get_size();
+	memory_entries.erase(itr->second);
+	memory_index.erase(itr);
+}
+static void memory_shrink(SceSize quota) {
+	while (memory_usage > quota) memory_remove(memory_entries.back().key);
+}
+static void memory_insert(const CacheEntry &entry) {
+	memory_remove(entry.key);
+	// a single huge entry (base.js) must not flush everything else
+	if (entry.get_size() > memory_quota / 2) return;
+	memory_shrink(memory_quota - entry.get_size());
+	memory_entries.push_front(entry);
+	memory_index[entry.key] = memory_entries.begin();
+	memory_usage += entry.get_size();
+}
+
+static void disk_load_index() {
+	if (disk_index_loaded) return;
+	disk_index_loaded = true;
+
+	SceUID dfd = sceIoDopen(NETWORK_CACHE_DIR);
+	if (dfd < 0) {
+		sceIoMkdir(NETWORK_CACHE_DIR, 0666);
+		return;
+	}
+	SceIoDirent dirent;
+	while (sceIoDread(dfd, &dirent) > 0) {
+		if (SCE_S_ISDIR(dirent.d_stat.st_mode)) continue;
+		std::string name = dirent.d_name;
+		disk_lru.push_back(name);
+		disk_index[name] = {(SceSize) dirent.d_stat.st_size, std::prev(disk_lru.end())};
+		disk_usage += dirent.d_stat.st_size;
+	}
+	sceIoDclose(dfd);
+}
+static void disk_remove(const std::string &name) {
+	auto itr = disk_index.find(name);
+	if (itr == disk_index.end()) return;
+	sceIoRemove((NETWORK_CACHE_DIR + name).c_str());
+	disk_usage -= itr->second.size;
+	disk_lru.erase(itr->second.lru_itr);
+	disk_index.erase(itr);
+}
+static void disk_shrink(SceSize quota) {
+	while (disk_usage > quota) disk_remove(disk_lru.back());
+}
+static void disk_write(const CacheEntry &entry) {
+	disk_load_index();
+	std::string name = get_file_name(entry.key);
+	disk_remove(name);
+
+	std::string content = serialize_entry(entry);
+	if (content.size() > disk_quota / 2) return;
+	disk_shrink(disk_quota - content.size());
+
+	std::string path = NETWORK_CACHE_DIR + name;
+	SceUID fd = sceIoOpen(path.c_str(), SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0666);
+	if (fd < 0) return;
+	bool ok = sceIoWrite(fd, content.data(), content.size()) == (int) content.size();
+	sceIoClose(fd);
+	if (!ok) { // e.g. savedata quota exceeded, a partial file would only be discarded on the next read
+		sceIoRemove(path.c_str());
+		return;
+	}
+	disk_lru.push_front(name);
+	disk_index[name] = {(SceSize) content.size(), disk_lru.begin()};
+	disk_usage += content.size();
+}
+static bool disk_read(const std::string &key, CacheEntry &entry) {
+	disk_load_index();
+	std::string name = get_file_name(key);
+	auto itr = disk_index.find(name);
+	if (itr == disk_index.end()) return false;
+
+	std::string content;
+	SceUID fd = sceIoOpen((NETWORK_CACHE_DIR + name).c_str(), SCE_O_RDONLY, 0);
+	bool ok = fd >= 0;
+	if (ok) {
+		content.resize(itr->second.size);
+		ok = sceIoRead(fd, &content[0], content.size()) == (int) content.size();
+		sceIoClose(fd);
+	}
+	if (!ok || !deserialize_entry(content, entry) || entry.key != key) { // corrupted, or a hash collision
+		disk_remove(name);
+		return false;
+	}
+	disk_lru.splice(disk_lru.begin(), disk_lru, itr->second.lru_itr);
+	return true;
+}
+
+static bool find_entry(const std::string &key, CacheEntry &entry) {
+	auto itr = memory_index.find(key);
+	if (itr != memory_index.end()) {
+		memory_entries.splice(memory_entries.begin(), memory_entries, itr->second);
+		entry = *itr->second;
+		return true;
+	}
+	if (disk_quota && disk_read(key, entry)) {
+		if (memory_quota) memory_insert(entry);
+		return true;
+	}
+	return false;
+}
+static void store_entry(const CacheEntry &entry) {
+	if (memory_quota) memory_insert(entry);
+	if (disk_quota) disk_write(entry);
+}
+static void remove_entry(const std::string &key) {
+	memory_remove(key);
+	if (disk_quota) {
+		disk_load_index();
+		disk_remove(get_file_name(key));
+	}
+}
+
+static void fill_result(const CacheEntry &entry, NetworkResult &res) {
+	res.status_code = 200;
+	res.fail = false;
+	res.error = "";
+	res.redirected_url = entry.redirected_url;
+	res.data = entry.data;
+	res.set_response_headers(entry.response_headers.data(), entry.response_headers.size());
+}
+
+
+void network_cache_set_quota(SceSize new_memory_quota, SceSize new_disk_quota) {
+	cache_lock.lock();
+	memory_quota = new_memory_quota;
+	disk_quota = new_disk_quota;
+	memory_shrink(memory_quota);
+	if (disk_index_loaded) disk_shrink(disk_quota);
+	cache_lock.unlock();
+}
+
+void network_cache_clear() {
+	cache_lock.lock();
+	memory_shrink(0);
+	disk_load_index();
+	disk_shrink(0);
+	cache_lock.unlock();
+}
+
+bool network_cache_lookup(const std::string &url, const std::map<std::string, std::string> &request_headers, NetworkResult &res,
+	std::map<std::string, std::string> &conditional_headers) {
+
+	if ((!memory_quota && !disk_quota) || request_headers.count("Range")) return false;
+
+	auto key = network_get_request_key(url, request_headers, true);
+	bool hit = false;
+	CacheEntry entry;
+	cache_lock.lock();
+	if (find_entry(key, entry)) {
+		if (time(NULL) < entry.fresh_until) {
+			fill_result(entry, res);
+			hit = true;
+		} else {
+			if (entry.etag.size()) conditional_headers["If-None-Match"] = entry.etag;
+			if (entry.last_modified.size()) conditional_headers["If-Modified-Since"] = entry.last_modified;
+		}
+	}
+	cache_lock.unlock();
+	return hit;
+}
+
+bool network_cache_update(const std::string &url, const std::map<std::string, std::string> &request_headers, NetworkResult &res) {
+	if (request_headers.count("Range") || res.fail) return true;
+	// the quotas may have been set to 0 after the lookup, which leaves nothing to answer a 304 with
+	if (!memory_quota && !disk_quota) return res.status_code != 304;
+	// a truncated body would otherwise be served (and revalidated with 304s) until the entry is evicted
+	if (res.status_code == 200 && !res.body_matches_content_length()) return true;
+
+	auto key = network_get_request_key(url, request_headers, true);
+	bool no_store;
+	SceInt64 lifetime = get_lifetime(res, no_store);
+
+	bool resolved = true;
+	cache_lock.lock();
+	if (res.status_code == 304) {
+		CacheEntry entry;
+		if (find_entry(key, entry)) {
+			// a 304 may carry updated freshness information and validators
+			entry.fresh_until = lifetime ? time(NULL) + lifetime : 0;
+			auto etag = res.get_header_view("ETag").str();
+			if (etag.size()) entry.etag = etag;
+			store_entry(entry);
+			fill_result(entry, res);
+		} else resolved = false;
+	} else if (res.status_code == 200) {
+		if (no_store) remove_entry(key);
+		else {
+			CacheEntry entry;
+			entry.key = key;
+			entry.redirected_url = res.redirected_url;
+			entry.etag = res.get_header_view("ETag").str();
+			entry.last_modified = res.get_header_view("Last-Modified").str();
+			entry.fresh_until = lifetime ? time(NULL) + lifetime : 0;
+			// nothing to gain from an entry that is never fresh and cannot be revalidated
+			if (entry.fresh_until || entry.etag.size() || entry.last_modified.size()) {
+				entry.response_headers = res.response_headers;
+				entry.data = res.data;
+				store_entry(entry);
+			} else remove_entry(key);
+		}
+	}
+	cache_lock.unlock();
+	return resolved;
+}
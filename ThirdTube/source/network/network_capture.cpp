@@ -0,0 +1,240 @@
+#include "network/network_capture.hpp"
+#include <vector>
+#include <deque>
+#include <cstring>
+
+/*
+	archive layout (all integers little-endian)
+	header : "TTHC" u32 version
+	record : u32 record_size, followed by
+		str method, str url, str range, str request_body,
+		s32 status_code, u8 fail, str error, str response_headers, str response_body,
+		u64 start_time (us since the start of the capture), u64 duration (us)
+	str : u32 length, followed by the raw bytes
+*/
+
+#define CAPTURE_MAGIC "TTHC"
+#define CAPTURE_VERSION 1
+
+struct CaptureEntry {
+	std::string method;
+	std::string url;
+	std::string range;
+	std::string request_body;
+	int status_code = -1;
+	bool fail = false;
+	std::string error;
+	std::string response_headers;
+	std::string response_body;
+	SceUInt64 start_time = 0;
+	SceUInt64 duration = 0;
+};
+
+static NetworkMutex capture_lock("capture_lock");
+static NetworkCaptureMode mode = NetworkCaptureMode::OFF;
+static SceUID capture_fd = -1;
+static SceUInt64 capture_start_time = 0;
+
+static bool replay_original_timing = false;
+static std::vector<CaptureEntry> replay_entries;
+static std::map<std::string, std::deque<size_t> > replay_queue; // key -> indexes of entries not yet replayed
+
+static std::string get_range(const std::map<std::string, std::string> &request_headers) {
+	auto itr = request_headers.find("Range");
+	return itr == request_headers.end() ? "" : itr->second;
+}
+static std::string get_key(const std::string &method, const std::string &url, const std::string &range, const std::string &body) {
+	return method + " " + url + "\n" + range + "\n" + body;
+}
+
+static void append_u32(std::string &out, SceUInt32 value) {
+	for (int i = 0; i < 4; i++) out.push_back((char) (value >> (i * 8) & 0xFF));
+}
+static void append_u64(std::string &out, SceUInt64 value) {
+	for (int i = 0; i < 8; i++) out.push_back((char) (value >> (i * 8) & 0xFF));
+}
+static void append_str(std::string &out, const char *data, size_t size) {
+	append_u32(out, size);
+	out.append(data, size);
+}
+static void append_str(std::string &out, const std::string &str) { append_str(out, str.data(), str.size()); }
+
+struct ArchiveReader {
+	const std::string &buffer;
+	size_t head;
+	bool error = false;
+
+	ArchiveReader (const std::string &buffer, size_t head) : buffer(buffer), head(head) {}
+
+	SceUInt64 read_int(int bytes) {
+		if (head + bytes > buffer.size()) {
+			error = true;
+			return 0;
+		}
+		SceUInt64 res = 0;
+		for (int i = 0; i < bytes; i++) res |= (SceUInt64) (uint8_t) buffer[head + i] << (i * 8);
+		head += bytes;
+		return res;
+	}
+	std::string read_str() {
+		size_t size = read_int(4);
+		if (error || head + size > buffer.size()) {
+			error = true;
+			return "";
+		}
+		head += size;
+		return buffer.substr(head - size, size);
+	}
+};
+
+static bool load_file(const std::string &path, std::string &out) {
+	SceUID fd = sceIoOpen(path.c_str(), SCE_O_RDONLY, 0);
+	if (fd < 0) return false;
+	SceOff size = sceIoLseek(fd, 0, SCE_SEEK_END);
+	sceIoLseek(fd, 0, SCE_SEEK_SET);
+	if (size < 0) {
+		sceIoClose(fd);
+		return false;
+	}
+	out.resize(size);
+	int read_size = size ? sceIoRead(fd, &out[0], size) : 0;
+	sceIoClose(fd);
+	return read_size == size;
+}
+
+static void close_capture_file() {
+	if (capture_fd >= 0) sceIoClose(capture_fd);
+	capture_fd = -1;
+}
+
+bool network_capture_start(const std::string &path) {
+	capture_lock.lock();
+	close_capture_file();
+	replay_entries.clear();
+	replay_queue.clear();
+
+	bool ok = false;
+	capture_fd = sceIoOpen(path.c_str(), SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0666);
+	if (capture_fd >= 0) {
+		std::string header = CAPTURE_MAGIC;
+		append_u32(header, CAPTURE_VERSION);
+		ok = sceIoWrite(capture_fd, header.data(), header.size()) == (int) header.size();
+		if (!ok) close_capture_file();
+	}
+	mode = ok ? NetworkCaptureMode::CAPTURE : NetworkCaptureMode::OFF;
+	capture_start_time = sceKernelGetProcessTimeWide();
+	capture_lock.unlock();
+	return ok;
+}
+
+bool network_replay_start(const std::string &path, bool original_timing) {
+	std::string buffer;
+	bool ok = load_file(path, buffer) && buffer.size() >= 8 && !memcmp(buffer.data(), CAPTURE_MAGIC, 4);
+
+	std::vector<CaptureEntry> entries;
+	if (ok) {
+		ArchiveReader reader(buffer, 4);
+		if (reader.read_int(4) != CAPTURE_VERSION) ok = false;
+		while (ok && reader.head < buffer.size()) {
+			size_t record_size = reader.read_int(4);
+			size_t record_end = reader.head + record_size;
+			CaptureEntry cur_entry;
+			cur_entry.method = reader.read_str();
+			cur_entry.url = reader.read_str();
+			cur_entry.range = reader.read_str();
+			cur_entry.request_body = reader.read_str();
+			cur_entry.status_code = (SceInt32) reader.read_int(4);
+			cur_entry.fail = reader.read_int(1);
+			cur_entry.error = reader.read_str();
+			cur_entry.response_headers = reader.read_str();
+			cur_entry.response_body = reader.read_str();
+			cur_entry.start_time = reader.read_int(8);
+			cur_entry.duration = reader.read_int(8);
+			// a truncated last record (e.g. the app was killed during capturing) is silently dropped
+			if (reader.error || reader.head > record_end) break;
+			reader.head = record_end; // skip fields added by newer versions
+			entries.push_back(cur_entry);
+		}
+	}
+
+	capture_lock.lock();
+	close_capture_file();
+	replay_entries.swap(entries);
+	replay_queue.clear();
+	for (size_t i = 0; i < replay_entries.size(); i++) {
+		const CaptureEntry &cur_entry = replay_entries[i];
+		replay_queue[get_key(cur_entry.method, cur_entry.url, cur_entry.range, cur_entry.request_body)].push_back(i);
+	}
+	replay_original_timing = original_timing;
+	mode = ok ? NetworkCaptureMode::REPLAY : NetworkCaptureMode::OFF;
+	capture_lock.unlock();
+	return ok;
+}
+
+void network_capture_stop() {
+	capture_lock.lock();
+	close_capture_file();
+	replay_entries.clear();
+	replay_queue.clear();
+	mode = NetworkCaptureMode::OFF;
+	capture_lock.unlock();
+}
+
+NetworkCaptureMode network_capture_get_mode() { return mode; }
+
+bool network_replay_lookup(const std::string &method, const std::string &url, const std::map<std::string, std::string> &request_headers,
+	const std::string &body, NetworkResult &res) {
+
+	if (mode != NetworkCaptureMode::REPLAY) return false;
+
+	SceUInt64 delay = 0;
+	capture_lock.lock();
+	auto itr = replay_queue.find(get_key(method, url, get_range(request_headers), body));
+	if (itr == replay_queue.end() || !itr->second.size()) {
+		res.fail = true;
+		res.error = "replay : no recorded response";
+	} else {
+		const CaptureEntry &entry = replay_entries[itr->second.front()];
+		// keep answering the last one if the session asks for it more often than it did while capturing
+		if (itr->second.size() > 1) itr->second.pop_front();
+
+		res.status_code = entry.status_code;
+		res.fail = entry.fail;
+		res.error = entry.error;
+		res.data.assign(entry.response_body.begin(), entry.response_body.end());
+		res.set_response_headers(entry.response_headers.data(), entry.response_headers.size());
+		if (replay_original_timing) delay = entry.duration;
+	}
+	capture_lock.unlock();
+
+	if (delay) sceKernelDelayThread(delay);
+	return true;
+}
+
+void network_capture_record(const std::string &method, const std::string &url, const std::map<std::string, std::string> &request_headers,
+	const std::string &body, const NetworkResult &res, SceUInt64 start_time, SceUInt64 duration) {
+
+	if (mode != NetworkCaptureMode::CAPTURE) return;
+
+	std::string record;
+	append_str(record, method);
+	append_str(record, url);
+	append_str(record, get_range(request_headers));
+	append_str(record, body);
+	append_u32(record, res.status_code);
+	record.push_back(res.fail ? 1 : 0);
+	append_str(record, res.error);
+	append_str(record, res.response_headers);
+	append_str(record, (const char *) res.data.data(), res.data.size());
+
+	capture_lock.lock();
+	if (capture_fd >= 0) {
+		append_u64(record, start_time > capture_start_time ? start_time - capture_start_time : 0);
+		append_u64(record, duration);
+		std::string size_prefix;
+		append_u32(size_prefix, record.size());
+		sceIoWrite(capture_fd, size_prefix.data(), size_prefix.size());
+		sceIoWrite(capture_fd, record.data(), record.size());
+	}
+	capture_lock.unlock();
+}
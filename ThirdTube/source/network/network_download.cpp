@@ -0,0 +1,263 @@
+#include "network/network_download.hpp"
+#include "network/network_range.hpp"
+#include "network/network_spill.hpp"
+#include <deque>
+#include <map>
+#include <cstdlib>
+
+#define DOWNLOAD_CHUNK_SIZE 0x100000 // 1 MiB per range request
+#define MAX_CHUNK_RETRY 3
+#define CHUNK_RETRY_INTERVAL (2 * 1000 * 1000) // us
+#define WORKER_THREAD_STACK_SIZE 0x10000
+
+struct DownloadTask {
+	int id;
+	std::vector<std::string> urls;
+	volatile NetworkDownloadState state = NetworkDownloadState::QUEUED;
+	volatile uint64_t downloaded = 0;
+	volatile uint64_t total = 0;
+	volatile bool stop_request = false;
+	bool remove_request = false;
+	NetworkRequestControl control; // of the request in progress
+};
+
+static NetworkMutex download_lock("download_lock");
+static std::string download_path = NETWORK_DOWNLOAD_DEFAULT_PATH;
+static volatile unsigned int rate_limit = 0;
+static std::map<int, DownloadTask *> tasks;
+static std::deque<DownloadTask *> queued_tasks;
+static int next_task_id = 0;
+static SceUID queue_sema = -1;
+static SceUID worker_thread = -1;
+
+
+static std::string get_file_path(const std::string &url, const char *extension) {
+	return download_path + network_spill_get_default_group(url) + "/" + network_spill_get_stream_key(url) + extension;
+}
+static SceOff get_file_size(const std::string &path) {
+	SceIoStat stat;
+	if (sceIoGetstat(path.c_str(), &stat) < 0) return -1;
+	return stat.st_size;
+}
+// "bytes 0-1048575/12345678" -> 12345678, 0 if unknown
+static uint64_t get_content_range_total(const NetworkResult &result) {
+	auto content_range = result.get_header_view("Content-Range").str();
+	auto pos = content_range.find('/');
+	if (pos == std::string::npos) return 0;
+	return strtoull(content_range.c_str() + pos + 1, NULL, 10);
+}
+
+static void remove_task_files(DownloadTask *task) {
+	for (auto &url : task->urls) {
+		sceIoRemove(get_file_path(url, ".part").c_str());
+		sceIoRemove(get_file_path(url, ".bin").c_str());
+		sceIoRmdir((download_path + network_spill_get_default_group(url)).c_str()); // fails while other streams of the video are left
+	}
+}
+
+// returns false if the download was stopped or failed
+static bool download_stream(DownloadTask *task, const std::string &url, uint64_t base_downloaded) {
+	std::string part_path = get_file_path(url, ".part");
+	std::string done_path = get_file_path(url, ".bin");
+	SceOff done_size = get_file_size(done_path);
+	if (done_size >= 0) {
+		task->downloaded = base_downloaded + done_size;
+		return true;
+	}
+	for (size_t pos = download_path.find('/'); pos != std::string::npos; pos = download_path.find('/', pos + 1))
+		sceIoMkdir(download_path.substr(0, pos).c_str(), 0777);
+	sceIoMkdir((download_path + network_spill_get_default_group(url)).c_str(), 0777);
+
+	// the partial file is only ever appended to, so its size is how far the download got
+	SceUID fd = sceIoOpen(part_path.c_str(), SCE_O_WRONLY | SCE_O_CREAT | SCE_O_APPEND, 0666);
+	if (fd < 0) return false;
+	uint64_t size = sceIoLseek(fd, 0, SCE_SEEK_END);
+	uint64_t clen = strtoull(url_get_param(url, "clen").c_str(), NULL, 10);
+	uint64_t len = clen; // corrected by the first response, 0 while unknown
+	bool len_counted = clen; // in the total of the task
+
+	SceUInt64 start_time = sceKernelGetProcessTimeWide();
+	uint64_t start_size = size;
+	int retry_left = MAX_CHUNK_RETRY;
+	bool ok = true;
+	bool end_reached = false; // only used while the length is unknown
+	while (len ? size < len : !end_reached) {
+		if (task->stop_request) {
+			ok = false;
+			break;
+		}
+		task->downloaded = base_downloaded + size;
+
+		NetworkResult result = Access_http_get_range(url, size, size + DOWNLOAD_CHUNK_SIZE - 1, {}, &task->control);
+		result.finalize();
+		if (task->stop_request) {
+			ok = false;
+			break;
+		}
+		// nothing left after `size` of a stream of unknown length (e.g. "Content-Range: bytes 0-1048575/*" so far)
+		if (!len && size && !result.fail && result.status_code == HTTP_STATUS_CODE_RANGE_NOT_SATISFIABLE) {
+			end_reached = true;
+			break;
+		}
+		// a server that ignores Range returns the whole content with 200, which is only usable from the beginning
+		bool valid = !result.fail && (result.status_code == HTTP_STATUS_CODE_PARTIAL_CONTENT || (result.status_code == HTTP_STATUS_CODE_OK && !size)) &&
+			result.body_matches_content_length();
+		if (valid && !len && !result.data.size()) { // an empty 206 : the end as well
+			end_reached = true;
+			break;
+		}
+		if (!valid || !result.data.size()) {
+			if (!retry_left--) {
+				ok = false;
+				break;
+			}
+			sceKernelDelayThread(CHUNK_RETRY_INTERVAL);
+			continue;
+		}
+		retry_left = MAX_CHUNK_RETRY;
+		uint64_t cur_len = result.status_code == HTTP_STATUS_CODE_OK ? result.data.size() : get_content_range_total(result);
+		if (cur_len) len = cur_len;
+		else if (result.data.size() < DOWNLOAD_CHUNK_SIZE) end_reached = true; // a short reply of a stream of unknown length is its last part
+		if (len && !len_counted) {
+			len_counted = true;
+			task->total = task->total + len;
+		}
+		if (sceIoWrite(fd, result.data.data(), result.data.size()) != (int) result.data.size()) {
+			ok = false;
+			break;
+		}
+		size += result.data.size();
+
+		// on top of the share the scheduler gives to background traffic
+		unsigned int cur_rate_limit = rate_limit;
+		if (cur_rate_limit) {
+			SceUInt64 expected_time = (size - start_size) * 1000000 / cur_rate_limit;
+			SceUInt64 elapsed_time = sceKernelGetProcessTimeWide() - start_time;
+			if (expected_time > elapsed_time) sceKernelDelayThread(expected_time - elapsed_time);
+		}
+	}
+	sceIoClose(fd);
+	task->downloaded = base_downloaded + size;
+	if (ok && !len_counted) task->total = task->total + size;
+	if (ok) ok = sceIoRename(part_path.c_str(), done_path.c_str()) >= 0;
+	return ok;
+}
+
+static void download_task(DownloadTask *task) {
+	// the total is known from the `clen` parameters beforehand, if they are present
+	uint64_t total = 0;
+	for (auto &url : task->urls) total += strtoull(url_get_param(url, "clen").c_str(), NULL, 10);
+	task->total = total;
+
+	uint64_t base_downloaded = 0;
+	bool ok = true;
+	for (auto &url : task->urls) {
+		if (!download_stream(task, url, base_downloaded)) {
+			ok = false;
+			break;
+		}
+		base_downloaded = task->downloaded;
+	}
+	if (ok && task->total < task->downloaded) task->total = task->downloaded;
+
+	download_lock.lock();
+	if (task->remove_request) {
+		remove_task_files(task);
+		tasks.erase(task->id);
+		delete task;
+	} else if (task->stop_request) task->state = NetworkDownloadState::PAUSED;
+	else task->state = ok ? NetworkDownloadState::DONE : NetworkDownloadState::ERROR;
+	download_lock.unlock();
+}
+
+static SceInt32 worker_thread_func(SceSize args, void *argp) {
+	while (1) {
+		sceKernelWaitSema(queue_sema, 1, NULL);
+		download_lock.lock();
+		DownloadTask *task = NULL;
+		if (queued_tasks.size()) {
+			task = queued_tasks.front();
+			queued_tasks.pop_front();
+			task->state = NetworkDownloadState::DOWNLOADING;
+		}
+		download_lock.unlock();
+		if (task) download_task(task);
+	}
+	return 0;
+}
+
+
+void network_download_set_path(const std::string &path) {
+	download_lock.lock();
+	download_path = path;
+	download_lock.unlock();
+}
+
+void network_download_set_rate_limit(unsigned int bytes_per_second) { rate_limit = bytes_per_second; }
+
+int network_download_start(const std::vector<std::string> &urls) {
+	DownloadTask *task = new DownloadTask();
+	task->urls = urls;
+	task->control.traffic_class = NetworkTrafficClass::BACKGROUND;
+
+	download_lock.lock();
+	int id = task->id = next_task_id++;
+	tasks[task->id] = task;
+	queued_tasks.push_back(task);
+	if (worker_thread < 0) {
+		queue_sema = sceKernelCreateSema("download_queue", 0, 0, 0x7FFFFFFF, NULL);
+		worker_thread = sceKernelCreateThread("download_worker", worker_thread_func, SCE_KERNEL_DEFAULT_PRIORITY_USER + 10, WORKER_THREAD_STACK_SIZE, 0, 0, NULL);
+		if (worker_thread >= 0) sceKernelStartThread(worker_thread, 0, NULL);
+	}
+	download_lock.unlock();
+	sceKernelSignalSema(queue_sema, 1);
+	return id;
+}
+
+static void stop_task(int id, bool remove) {
+	download_lock.lock();
+	auto itr = tasks.find(id);
+	if (itr == tasks.end()) {
+		download_lock.unlock();
+		return;
+	}
+	DownloadTask *task = itr->second;
+	if (task->state == NetworkDownloadState::DOWNLOADING) { // the worker thread finishes it
+		task->stop_request = true;
+		task->remove_request = remove;
+		task->control.abort();
+	} else {
+		for (size_t i = 0; i < queued_tasks.size(); i++) if (queued_tasks[i] == task) {
+			queued_tasks.erase(queued_tasks.begin() + i);
+			break;
+		}
+		if (remove) {
+			remove_task_files(task);
+			tasks.erase(itr);
+			delete task;
+		} else if (task->state == NetworkDownloadState::QUEUED) task->state = NetworkDownloadState::PAUSED;
+	}
+	download_lock.unlock();
+}
+void network_download_pause(int id) { stop_task(id, false); }
+void network_download_cancel(int id) { stop_task(id, true); }
+
+bool network_download_get_progress(int id, unsigned long long *downloaded, unsigned long long *total, NetworkDownloadState *state) {
+	download_lock.lock();
+	auto itr = tasks.find(id);
+	bool found = itr != tasks.end();
+	if (found) {
+		*downloaded = itr->second->downloaded;
+		*total = itr->second->total;
+		*state = itr->second->state;
+	}
+	download_lock.unlock();
+	return found;
+}
+
+std::string network_download_get_local_path(const std::string &url) {
+	download_lock.lock();
+	std::string path = get_file_path(url, ".bin");
+	download_lock.unlock();
+	return get_file_size(path) > 0 ? path : "";
+}
@@ -0,0 +1,732 @@
+#include "network/network_downloader.hpp"
+#include "network/network_range.hpp"
+#include "network/network_spill.hpp"
+#include "network/network_download.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+#define IDLE_INTERVAL 20000 // us
+#define BLOCK_THREAD_STACK_SIZE 0x10000
+
+#define AVIO_WAIT_INTERVAL 10000 // us
+#define MAX_BLOCK_FETCH_RETRY 1 // for range replies that are not 206 or have the wrong length
+
+#define MAX_FIRST_BLOCK_PREFETCHES 4
+#define FIRST_BLOCK_PREFETCH_EXPIRY (60 * 1000 * 1000) // us, the signature of a media url is only valid for a limited time anyway
+#define FIRST_BLOCK_PREFETCH_STACK_SIZE 0x10000
+
+#define MAX_KNOWN_HEADER_SIZES 64
+
+static NetworkMutex header_sizes_lock("header_sizes_lock");
+static std::map<std::string, uint64_t> header_sizes; // key : stream url
+
+void network_stream_set_header_size(const std::string &url, uint64_t header_size) {
+	header_sizes_lock.lock();
+	// the urls of earlier videos are never used again once they expire
+	if (header_sizes.size() >= MAX_KNOWN_HEADER_SIZES && !header_sizes.count(url)) header_sizes.clear();
+	header_sizes[url] = header_size;
+	header_sizes_lock.unlock();
+}
+
+NetworkStream::NetworkStream (std::string url, bool whole_download) : url(url), downloaded_data_lock("stream_data_lock"), whole_download(whole_download),
+	spill_group(network_spill_get_default_group(url)), spill_key(network_spill_get_stream_key(url)) {
+	
+	// media urls carry the duration of the stream (e.g. "dur=212.321"), livestream urls do not
+	std::string dur = url_get_param(url, "dur");
+	if (dur.size()) duration = std::max(strtod(dur.c_str(), NULL), 0.0);
+	if (!whole_download) {
+		header_sizes_lock.lock();
+		auto itr = header_sizes.find(url);
+		if (itr != header_sizes.end()) header_size = itr->second;
+		header_sizes_lock.unlock();
+	}
+}
+
+NetworkStream::~NetworkStream () {
+	downloaded_data_lock.lock();
+	for (auto block : blocks) if (block) release_block(block);
+	downloaded_data_lock.unlock();
+}
+
+void NetworkStream::set_block_num(uint64_t block_num) {
+	downloaded_data_lock.lock();
+	this->block_num = block_num;
+	blocks.resize(block_num, NULL);
+	downloaded_data_lock.unlock();
+}
+
+void NetworkStream::release_block(NetworkStreamBlock *block) {
+	if (!--block->ref_count) delete block;
+}
+
+NetworkStreamBlock *NetworkStream::pin_block(uint64_t block) {
+	downloaded_data_lock.lock();
+	NetworkStreamBlock *res = block < blocks.size() ? blocks[block] : NULL;
+	if (res) res->ref_count++;
+	downloaded_data_lock.unlock();
+	return res;
+}
+void NetworkStream::unpin_block(NetworkStreamBlock *block) {
+	downloaded_data_lock.lock();
+	release_block(block);
+	downloaded_data_lock.unlock();
+}
+
+bool NetworkStream::is_data_available(uint64_t start, uint64_t size) {
+	if (!ready) return false;
+	if (start + size > len) return false;
+	if (!size) return true;
+	uint64_t start_block = start / BLOCK_SIZE;
+	uint64_t end_block = (start + size - 1) / BLOCK_SIZE;
+	
+	bool res = true;
+	downloaded_data_lock.lock();
+	for (uint64_t block = start_block; block <= end_block; block++) {
+		if (!blocks[block]) {
+			res = false;
+			break;
+		}
+	}
+	downloaded_data_lock.unlock();
+	return res;
+}
+
+int NetworkStream::read_into(uint64_t start, uint8_t *dst, int size) {
+	if (!ready) return 0;
+	if (start >= len) return -1;
+	size = std::min<uint64_t>(size, len - start);
+	
+	int res = 0;
+	while (res < size) {
+		uint64_t cur_pos = start + res;
+		uint64_t block_index = cur_pos / BLOCK_SIZE;
+		NetworkStreamBlock *block = pin_block(block_index);
+		if (!block) break;
+		// the block is immutable and pinned, so it can be read without holding the lock
+		uint64_t offset = cur_pos - block_index * BLOCK_SIZE;
+		if (offset >= block->data.size()) { // set_data() does not let this happen
+			unpin_block(block);
+			error = true;
+			break;
+		}
+		int cur_size = std::min<uint64_t>(size - res, block->data.size() - offset);
+		memcpy(dst + res, block->data.data() + offset, cur_size);
+		unpin_block(block);
+		res += cur_size;
+	}
+	return res;
+}
+
+std::vector<uint8_t> NetworkStream::get_data(uint64_t start, uint64_t size) {
+	std::vector<uint8_t> res(size);
+	if (size) read_into(start, res.data(), size);
+	return res;
+}
+
+bool NetworkStream::set_data(uint64_t block, std::vector<uint8_t> &&data) {
+	uint64_t cur_len = len;
+	if (block * BLOCK_SIZE >= cur_len || data.size() != std::min(block * BLOCK_SIZE + BLOCK_SIZE, cur_len) - block * BLOCK_SIZE) return false;
+	NetworkStreamBlock *new_block = new NetworkStreamBlock();
+	new_block->data.swap(data);
+	
+	downloaded_data_lock.lock();
+	if (block >= blocks.size()) blocks.resize(block + 1, NULL);
+	if (blocks[block]) release_block(blocks[block]);
+	else cached_block_num++;
+	blocks[block] = new_block;
+	evict();
+	downloaded_data_lock.unlock();
+	return true;
+}
+
+void NetworkStream::set_cache_budget(uint64_t ahead_blocks, uint64_t behind_blocks) {
+	downloaded_data_lock.lock();
+	max_ahead_blocks = ahead_blocks;
+	max_behind_blocks = behind_blocks;
+	evict();
+	downloaded_data_lock.unlock();
+}
+
+void NetworkStream::evict() {
+	// blocks farthest from the read head go first, on each side separately
+	uint64_t read_head_block = std::min<uint64_t>(read_head / BLOCK_SIZE, blocks.size());
+	uint64_t behind_num = 0;
+	for (uint64_t block = 0; block < read_head_block; block++) if (blocks[block]) behind_num++;
+	uint64_t ahead_num = cached_block_num - behind_num;
+	for (uint64_t block = 0; block < read_head_block && behind_num > max_behind_blocks; block++) {
+		if (!blocks[block]) continue;
+		drop_block(block);
+		behind_num--;
+	}
+	for (uint64_t block = blocks.size(); block > read_head_block && ahead_num > max_ahead_blocks; block--) {
+		if (!blocks[block - 1]) continue;
+		drop_block(block - 1);
+		ahead_num--;
+	}
+}
+
+void NetworkStream::drop_block(uint64_t block) {
+	NetworkStreamBlock *cur_block = blocks[block];
+	blocks[block] = NULL;
+	cached_block_num--;
+	// when no reader has it pinned, the block can be handed over to the disk tier without copying
+	if (cur_block->ref_count == 1 && !whole_download && local_path == "" && network_spill_is_enabled()) network_spill_store(spill_group, spill_key, block, cur_block);
+	else release_block(cur_block);
+}
+
+void NetworkStream::set_time_map(std::vector<std::pair<uint64_t, double> > &&time_map) {
+	downloaded_data_lock.lock();
+	this->time_map.swap(time_map);
+	downloaded_data_lock.unlock();
+}
+
+double NetworkStream::get_time_of(uint64_t offset) {
+	double res = -1;
+	downloaded_data_lock.lock();
+	if (time_map.size()) {
+		// interpolate between the two surrounding entries, extrapolating with the last segment's rate at the end
+		auto itr = std::upper_bound(time_map.begin(), time_map.end(), std::make_pair(offset, 1e100));
+		if (itr == time_map.begin()) res = time_map[0].second;
+		else {
+			auto prev = std::prev(itr);
+			auto next = itr != time_map.end() ? itr : prev;
+			if (next == prev && prev != time_map.begin()) prev = std::prev(prev);
+			if (next->first > prev->first) res = prev->second + (next->second - prev->second) * ((double) offset - prev->first) / (next->first - prev->first);
+			else res = prev->second;
+		}
+	}
+	downloaded_data_lock.unlock();
+	double cur_duration = duration;
+	if (res < 0 && cur_duration > 0 && len) res = cur_duration * offset / len;
+	return res;
+}
+
+double NetworkStream::get_buffered_seconds() {
+	uint64_t start = read_head;
+	if (!ready || start >= len) return ready ? 0 : -1;
+	uint64_t end = start / BLOCK_SIZE;
+	downloaded_data_lock.lock();
+	while (end < block_num && blocks[end]) end++;
+	downloaded_data_lock.unlock();
+	end = std::min(end * BLOCK_SIZE, len);
+	if (end <= start) return 0;
+	double start_time = get_time_of(start);
+	double end_time = get_time_of(end);
+	if (start_time < 0 || end_time < 0) return -1;
+	return std::max(end_time - start_time, 0.0);
+}
+
+uint64_t NetworkStream::get_first_request_size(uint64_t header_size) {
+	uint64_t blocks = std::max<uint64_t>((header_size + BLOCK_SIZE - 1) / BLOCK_SIZE, 1);
+	return std::min(blocks, MAX_FIRST_REQUEST_BLOCKS) * BLOCK_SIZE;
+}
+
+uint64_t NetworkStream::get_byte_rate() {
+	double cur_duration = duration;
+	return cur_duration > 0 ? len / cur_duration : 0;
+}
+
+double NetworkStream::get_download_percentage() {
+	if (!ready || !len) return 0;
+	downloaded_data_lock.lock();
+	double res = (double) std::min<uint64_t>(cached_block_num * BLOCK_SIZE, len) * 100 / len;
+	downloaded_data_lock.unlock();
+	return res;
+}
+
+std::vector<double> NetworkStream::get_buffering_progress_bar(int res_len) {
+	std::vector<double> res(res_len);
+	if (!ready || !block_num) return res;
+	downloaded_data_lock.lock();
+	for (uint64_t block = 0; block < blocks.size(); block++) {
+		if (!blocks[block]) continue;
+		// spread the block over the part of the bar it covers
+		double l = (double) block * res_len / block_num;
+		double r = (double) (block + 1) * res_len / block_num;
+		for (int i = std::max(0, (int) l); i < res_len && i < r; i++)
+			res[i] += (std::min<double>(r, i + 1) - std::max<double>(l, i)) * 100;
+	}
+	downloaded_data_lock.unlock();
+	for (auto &i : res) i = std::min(i, 100.0);
+	return res;
+}
+
+int network_stream_avio_read(void *opaque, uint8_t *buf, int buf_size) {
+	NetworkStream *stream = (NetworkStream *) opaque;
+	while (1) {
+		if (stream->quit_request) return NETWORK_STREAM_AVERROR_EOF;
+		if (stream->error) return NETWORK_STREAM_AVERROR_EIO;
+		int read_size = stream->read_into(stream->read_head, buf, buf_size);
+		if (read_size < 0) return NETWORK_STREAM_AVERROR_EOF;
+		if (read_size > 0) {
+			stream->network_waiting_status = NULL;
+			stream->read_head += read_size;
+			return read_size;
+		}
+		stream->network_waiting_status = "Reading stream";
+		sceKernelDelayThread(AVIO_WAIT_INTERVAL);
+	}
+}
+
+
+NetworkStreamDownloader::NetworkStreamDownloader () : streams_lock("streams_lock") {}
+
+void NetworkStreamDownloader::add_stream(NetworkStream *stream) {
+	streams_lock.lock();
+	streams.push_back(stream);
+	streams_lock.unlock();
+}
+
+void NetworkStreamDownloader::delete_all() {
+	streams_lock.lock();
+	// the downloader thread may be fetching blocks of any of them, so it deletes them itself
+	if (thread_running) for (auto stream : streams) stream->quit_request = true;
+	else {
+		for (auto stream : streams) delete stream;
+		streams.clear();
+	}
+	streams_lock.unlock();
+}
+
+struct FirstBlockPrefetch {
+	std::string url;
+	uint64_t size;
+	NetworkResult result;
+	SceUID thread = -1;
+	SceUInt64 start_time = 0;
+};
+static NetworkMutex first_block_prefetch_lock("first_block_prefetch_lock");
+static std::vector<FirstBlockPrefetch *> first_block_prefetches; // oldest first
+
+static SceInt32 first_block_prefetch_thread(SceSize args, void *argp) {
+	FirstBlockPrefetch *prefetch = *(FirstBlockPrefetch **) argp;
+	NetworkRequestControl control;
+	// the player is about to need it, but nothing is playing yet
+	control.traffic_class = NetworkTrafficClass::INTERACTIVE;
+	prefetch->result = Access_http_get_range(prefetch->url, 0, prefetch->size - 1, {}, &control);
+	prefetch->result.finalize();
+	return 0;
+}
+static void delete_first_block_prefetch(FirstBlockPrefetch *prefetch) {
+	sceKernelWaitThreadEnd(prefetch->thread, NULL, NULL);
+	sceKernelDeleteThread(prefetch->thread);
+	delete prefetch;
+}
+
+void network_stream_prefetch_first_block(const std::string &url, uint64_t header_size) {
+	std::vector<FirstBlockPrefetch *> expired;
+	first_block_prefetch_lock.lock();
+	for (auto prefetch : first_block_prefetches) if (prefetch->url == url) {
+		first_block_prefetch_lock.unlock();
+		return;
+	}
+	SceUInt64 now = sceKernelGetProcessTimeWide();
+	while (first_block_prefetches.size() && (first_block_prefetches.size() >= MAX_FIRST_BLOCK_PREFETCHES ||
+		now - first_block_prefetches[0]->start_time >= FIRST_BLOCK_PREFETCH_EXPIRY)) {
+		expired.push_back(first_block_prefetches[0]);
+		first_block_prefetches.erase(first_block_prefetches.begin());
+	}
+	FirstBlockPrefetch *prefetch = new FirstBlockPrefetch();
+	prefetch->url = url;
+	prefetch->size = NetworkStream::get_first_request_size(header_size);
+	prefetch->start_time = now;
+	prefetch->thread = sceKernelCreateThread("first_block_prefetch", first_block_prefetch_thread, SCE_KERNEL_DEFAULT_PRIORITY_USER, FIRST_BLOCK_PREFETCH_STACK_SIZE, 0, 0, NULL);
+	if (prefetch->thread >= 0 && sceKernelStartThread(prefetch->thread, sizeof(prefetch), &prefetch) >= 0) first_block_prefetches.push_back(prefetch);
+	else {
+		if (prefetch->thread >= 0) sceKernelDeleteThread(prefetch->thread);
+		delete prefetch;
+	}
+	first_block_prefetch_lock.unlock();
+	// waiting for the threads of the expired ones must not block other callers
+	for (auto cur_prefetch : expired) delete_first_block_prefetch(cur_prefetch);
+}
+
+// takes the result of network_stream_prefetch_first_block(url) of at least `size` bytes if there is one, waiting for it if it is
+// still in progress; `size` is set to the size of the prefetch
+static bool take_first_block_prefetch(const std::string &url, uint64_t &size, NetworkResult &result) {
+	FirstBlockPrefetch *prefetch = NULL;
+	first_block_prefetch_lock.lock();
+	for (size_t i = 0; i < first_block_prefetches.size(); i++) if (first_block_prefetches[i]->url == url && first_block_prefetches[i]->size >= size) {
+		prefetch = first_block_prefetches[i];
+		first_block_prefetches.erase(first_block_prefetches.begin() + i);
+		break;
+	}
+	first_block_prefetch_lock.unlock();
+	if (!prefetch) return false;
+	
+	sceKernelWaitThreadEnd(prefetch->thread, NULL, NULL);
+	bool ok = !prefetch->result.fail && prefetch->result.status_code_is_success() &&
+		sceKernelGetProcessTimeWide() - prefetch->start_time < FIRST_BLOCK_PREFETCH_EXPIRY;
+	if (ok) {
+		result = std::move(prefetch->result);
+		size = prefetch->size;
+	}
+	delete_first_block_prefetch(prefetch);
+	return ok;
+}
+
+// reads the block from NetworkStream::local_path, returns false if it could not be read entirely
+static bool read_local_block(NetworkStream *stream, uint64_t block, std::vector<uint8_t> &data) {
+	SceUID fd = sceIoOpen(stream->local_path.c_str(), SCE_O_RDONLY, 0);
+	if (fd < 0) return false;
+	uint64_t start = block * NetworkStream::BLOCK_SIZE;
+	data.resize(std::min(start + NetworkStream::BLOCK_SIZE, stream->len) - start);
+	bool ok = sceIoPread(fd, data.data(), data.size(), start) == (int) data.size();
+	sceIoClose(fd);
+	return ok;
+}
+static bool open_local_stream(NetworkStream *stream) {
+	SceIoStat stat;
+	if (sceIoGetstat(stream->local_path.c_str(), &stat) < 0 || stat.st_size <= 0) return false;
+	stream->len = stat.st_size;
+	stream->set_block_num((stream->len + NetworkStream::BLOCK_SIZE - 1) / NetworkStream::BLOCK_SIZE);
+	std::vector<uint8_t> data;
+	return read_local_block(stream, 0, data) && stream->set_data(0, std::move(data));
+}
+
+// "bytes 0-262143/12345678" -> 12345678, 0 if unknown
+static uint64_t get_content_range_total(const NetworkResult &result) {
+	auto content_range = result.get_header_view("Content-Range").str();
+	auto pos = content_range.find('/');
+	if (pos == std::string::npos) return 0;
+	return strtoull(content_range.c_str() + pos + 1, NULL, 10);
+}
+// a range reply is only used if it is a 206 with exactly the requested number of bytes
+// (a 200 carries the whole content, and a body cut short by the connection does not set `fail`)
+static bool is_complete_range_reply(const NetworkResult &result, uint64_t expected_size) {
+	return !result.fail && result.status_code == HTTP_STATUS_CODE_PARTIAL_CONTENT && result.data.size() == expected_size;
+}
+// the same for a request of [0, size) of a stream of unknown length
+static bool is_complete_first_range_reply(const NetworkResult &result, uint64_t size) {
+	uint64_t total = get_content_range_total(result);
+	return total && is_complete_range_reply(result, std::min(size, total));
+}
+
+void NetworkStreamDownloader::fetch_first_block(NetworkStream *stream) {
+	if (!stream->whole_download) {
+		// a downloaded stream does not touch the network at all
+		stream->local_path = network_download_get_local_path(stream->url);
+		if (stream->local_path != "") {
+			if (open_local_stream(stream)) {
+				stream->ready = true;
+				return;
+			}
+			stream->local_path = "";
+		}
+	}
+	NetworkRequestControl control;
+	control.traffic_class = stream->prefetch ? NetworkTrafficClass::PREFETCH : NetworkTrafficClass::PLAYBACK;
+	NetworkResult result;
+	bool ok;
+	if (stream->whole_download) {
+		result = Access_http_get(stream->url, {}, true, &control);
+		result.finalize();
+		ok = !result.fail && result.status_code == HTTP_STATUS_CODE_OK && result.body_matches_content_length();
+	} else {
+		// the initialization data and the index come in the same request as the beginning of the media
+		uint64_t size = NetworkStream::get_first_request_size(stream->header_size);
+		uint64_t prefetch_size = size;
+		ok = take_first_block_prefetch(stream->url, prefetch_size, result) && is_complete_first_range_reply(result, prefetch_size);
+		for (int i = 0; !ok && i <= MAX_BLOCK_FETCH_RETRY; i++) {
+			result = Access_http_get_range(stream->url, 0, size - 1, {}, &control);
+			result.finalize();
+			ok = is_complete_first_range_reply(result, size);
+			if (result.fail || !result.status_code_is_success()) break;
+		}
+	}
+	if (!ok) {
+		stream->error = true;
+		return;
+	}
+	if (stream->whole_download) {
+		auto seq_head = result.get_header_view("X-Head-Seqnum");
+		auto seq_id = result.get_header_view("X-Sequence-Num");
+		if (seq_head.found) stream->seq_head = atoi(seq_head.str().c_str());
+		if (seq_id.found) stream->seq_id = atoi(seq_id.str().c_str());
+		auto head_time = result.get_header_view("X-Head-Time-Millis");
+		if (head_time.found) stream->head_time = strtoull(head_time.str().c_str(), NULL, 10) / 1000.0;
+	}
+	uint64_t len = stream->whole_download ? result.data.size() : get_content_range_total(result);
+	stream->len = len;
+	stream->set_block_num((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	if (result.data.size() <= BLOCK_SIZE) ok = stream->set_data(0, std::move(result.data));
+	else {
+		for (uint64_t block = 0; ok && block * BLOCK_SIZE < result.data.size() && block < stream->block_num; block++) {
+			auto begin = result.data.begin() + block * BLOCK_SIZE;
+			auto end = result.data.begin() + std::min<uint64_t>((block + 1) * BLOCK_SIZE, result.data.size());
+			ok = stream->set_data(block, std::vector<uint8_t>(begin, end));
+		}
+	}
+	if (!ok) stream->error = true;
+	else stream->ready = true;
+}
+
+struct FirstBlockFetch {
+	NetworkStream *stream;
+	SceUID thread = -1;
+};
+SceInt32 NetworkStreamDownloader::first_block_fetch_thread(SceSize args, void *argp) {
+	FirstBlockFetch *fetch = *(FirstBlockFetch **) argp;
+	fetch_first_block(fetch->stream);
+	return 0;
+}
+void NetworkStreamDownloader::fetch_first_blocks(const std::vector<NetworkStream *> &new_streams) {
+	// the first stream is fetched on this thread, the rest on their own threads
+	std::vector<FirstBlockFetch *> fetches;
+	for (auto stream : new_streams) {
+		FirstBlockFetch *fetch = new FirstBlockFetch();
+		fetch->stream = stream;
+		if (fetches.size()) {
+			fetch->thread = sceKernelCreateThread("first_block_fetch", first_block_fetch_thread, SCE_KERNEL_DEFAULT_PRIORITY_USER, BLOCK_THREAD_STACK_SIZE, 0, 0, NULL);
+			if (fetch->thread >= 0 && sceKernelStartThread(fetch->thread, sizeof(fetch), &fetch) < 0) {
+				sceKernelDeleteThread(fetch->thread);
+				fetch->thread = -1;
+			}
+			if (fetch->thread < 0) {
+				delete fetch;
+				break;
+			}
+		}
+		fetches.push_back(fetch);
+	}
+	fetch_first_block(fetches[0]->stream);
+	for (auto fetch : fetches) {
+		if (fetch->thread >= 0) {
+			sceKernelWaitThreadEnd(fetch->thread, NULL, NULL);
+			sceKernelDeleteThread(fetch->thread);
+		}
+		delete fetch;
+	}
+}
+
+struct BlockFetch {
+	NetworkStream *stream;
+	uint64_t block;
+	NetworkResult result;
+	SceUID thread = -1;
+};
+static SceInt32 block_fetch_thread(SceSize args, void *argp) {
+	BlockFetch *fetch = *(BlockFetch **) argp;
+	uint64_t start = fetch->block * NetworkStream::BLOCK_SIZE;
+	uint64_t end = std::min(start + NetworkStream::BLOCK_SIZE, fetch->stream->len) - 1;
+	NetworkRequestControl control;
+	control.traffic_class = NetworkTrafficClass::PLAYBACK;
+	// Access_http_get_range() already retries failed transfers, this is for replies that are not the requested range
+	for (int i = 0; i <= MAX_BLOCK_FETCH_RETRY; i++) {
+		fetch->result = Access_http_get_range(fetch->stream->url, start, end, {}, &control);
+		fetch->result.finalize();
+		if (is_complete_range_reply(fetch->result, end - start + 1)) return 0;
+		if (fetch->result.fail || !fetch->result.status_code_is_success()) break;
+	}
+	fetch->result.fail = true;
+	if (fetch->result.error == "") fetch->result.error = "incomplete range reply";
+	return 0;
+}
+
+void NetworkStreamDownloader::fetch_blocks(const std::vector<BlockRequest> &requests) {
+	// blocks spilled to disk earlier are read back instead of downloaded
+	std::vector<BlockRequest> remote_requests;
+	for (auto &request : requests) {
+		NetworkStream *stream = request.stream;
+		std::vector<uint8_t> data;
+		if (stream->local_path != "") {
+			if (!read_local_block(stream, request.block, data) || !stream->set_data(request.block, std::move(data))) stream->error = true;
+		} else if (!network_spill_load(stream->spill_group, stream->spill_key, request.block, data) || !stream->set_data(request.block, std::move(data)))
+			remote_requests.push_back(request);
+	}
+	if (!remote_requests.size()) return;
+	
+	SceUInt64 start_time = sceKernelGetProcessTimeWide();
+	std::vector<BlockFetch *> fetches;
+	for (auto &request : remote_requests) {
+		BlockFetch *fetch = new BlockFetch();
+		fetch->stream = request.stream;
+		fetch->block = request.block;
+		// the first block is fetched on this thread, the rest on their own threads
+		if (fetches.size()) {
+			fetch->thread = sceKernelCreateThread("block_fetch", block_fetch_thread, SCE_KERNEL_DEFAULT_PRIORITY_USER, BLOCK_THREAD_STACK_SIZE, 0, 0, NULL);
+			if (fetch->thread >= 0 && sceKernelStartThread(fetch->thread, sizeof(fetch), &fetch) < 0) {
+				sceKernelDeleteThread(fetch->thread);
+				fetch->thread = -1;
+			}
+			if (fetch->thread < 0) { // fall back to fewer connections
+				delete fetch;
+				break;
+			}
+		}
+		fetches.push_back(fetch);
+	}
+	block_fetch_thread(sizeof(fetches[0]), &fetches[0]);
+
+	uint64_t bytes = 0;
+	bool failed = false;
+	for (auto fetch : fetches) {
+		if (fetch->thread >= 0) {
+			sceKernelWaitThreadEnd(fetch->thread, NULL, NULL);
+			sceKernelDeleteThread(fetch->thread);
+		}
+		// each block is placed into the cache as-is, so completion order does not matter
+		if (fetch->result.fail || !fetch->result.status_code_is_success()) {
+			fetch->stream->error = true;
+			failed = true;
+		} else {
+			bytes += fetch->result.data.size();
+			if (!fetch->stream->set_data(fetch->block, std::move(fetch->result.data))) {
+				fetch->stream->error = true;
+				failed = true;
+			}
+		}
+		delete fetch;
+	}
+	SceUInt64 batch_time = sceKernelGetProcessTimeWide() - start_time;
+	transferred_bytes = transferred_bytes + bytes;
+	transfer_time = transfer_time + batch_time;
+	if (!failed) update_connection_num(remote_requests.size() == fetches.size() ? fetches.size() : 0, bytes, batch_time);
+}
+
+double NetworkStreamDownloader::get_deadline(NetworkStream *stream, uint64_t block) {
+	uint64_t block_start = block * BLOCK_SIZE;
+	double block_time = stream->get_time_of(block_start);
+	if (block_time < 0) { // nothing is known about the stream's timing
+		uint64_t read_head = stream->read_head;
+		return (double) (block_start > read_head ? block_start - read_head : 0) / DEFAULT_BYTE_RATE;
+	}
+	double position = stream->playback_position;
+	// the demuxer reads a little ahead of the decoder, so read_head gives a slightly late estimate of the position
+	if (position < 0) position = std::max(0.0, stream->get_time_of(stream->read_head));
+	return block_time - position;
+}
+
+void NetworkStreamDownloader::update_connection_num(int used_connections, uint64_t bytes, SceUInt64 duration) {
+	// only batches that used the whole current connection count say something about it
+	if (used_connections != connection_num || !duration) return;
+	uint64_t cur_throughput = bytes * 1000000 / duration;
+	throughput[connection_num] = throughput[connection_num] ? (throughput[connection_num] * 3 + cur_throughput) / 4 : cur_throughput;
+
+	if (++batch_count % REPROBE_INTERVAL == 0 && connection_num < MAX_CONNECTIONS) throughput[connection_num + 1] = 0; // conditions may have changed
+
+	// one more connection is tried until measured, and kept only if it was at least 10% faster
+	if (connection_num < MAX_CONNECTIONS && (!throughput[connection_num + 1] || throughput[connection_num + 1] * 10 > throughput[connection_num] * 11))
+		connection_num++;
+	else if (connection_num > 1 && throughput[connection_num - 1] * 11 >= throughput[connection_num] * 10)
+		connection_num--;
+}
+
+void NetworkStreamDownloader::update_budgets() {
+	uint64_t total_byte_rate = 0;
+	uint64_t known_byte_rate_num = 0;
+	for (auto stream : streams) {
+		uint64_t byte_rate = stream->get_byte_rate();
+		total_byte_rate += byte_rate;
+		if (byte_rate) known_byte_rate_num++;
+	}
+	// streams of unknown bitrate get the average weight of the others (or equal weights if nothing is known)
+	uint64_t default_weight = known_byte_rate_num ? total_byte_rate / known_byte_rate_num : 1;
+	uint64_t weight_sum = 0;
+	for (auto stream : streams) weight_sum += stream->get_byte_rate() ? stream->get_byte_rate() : default_weight;
+	
+	// the closer playback comes to using the whole link, the more readahead is needed to ride out fluctuations
+	uint64_t bandwidth = throughput[connection_num];
+	int readahead_seconds = MAX_READAHEAD_SECONDS;
+	if (bandwidth && total_byte_rate)
+		readahead_seconds = std::min<uint64_t>(MIN_READAHEAD_SECONDS + MAX_READAHEAD_SECONDS * total_byte_rate / bandwidth, MAX_READAHEAD_SECONDS);
+	
+	for (auto stream : streams) {
+		if (!stream->ready) continue;
+		uint64_t byte_rate = stream->get_byte_rate();
+		uint64_t budget_blocks = memory_budget * (byte_rate ? byte_rate : default_weight) / std::max<uint64_t>(weight_sum, 1) / BLOCK_SIZE;
+		budget_blocks = std::max(budget_blocks, MIN_STREAM_BLOCKS);
+		uint64_t behind_blocks = budget_blocks / 4;
+		uint64_t ahead_blocks = budget_blocks - behind_blocks;
+		stream->set_cache_budget(ahead_blocks, behind_blocks);
+		
+		uint64_t readahead_blocks = byte_rate ? (byte_rate * readahead_seconds + BLOCK_SIZE - 1) / BLOCK_SIZE : MAX_FORWARD_READ_BLOCKS;
+		stream->readahead_blocks = std::max<uint64_t>(std::min(readahead_blocks, ahead_blocks), 1);
+	}
+}
+
+double NetworkStreamDownloader::get_buffered_seconds() {
+	double res = -1;
+	streams_lock.lock();
+	for (auto stream : streams) {
+		if (stream->suspend_request || stream->quit_request) continue;
+		double cur_buffered = stream->get_buffered_seconds();
+		if (cur_buffered >= 0 && (res < 0 || cur_buffered < res)) res = cur_buffered;
+	}
+	streams_lock.unlock();
+	return res;
+}
+
+void NetworkStreamDownloader::downloader_thread() {
+	streams_lock.lock();
+	thread_running = true;
+	streams_lock.unlock();
+	
+	while (!thread_exit_reqeusted) {
+		std::vector<NetworkStream *> new_streams;
+
+		streams_lock.lock();
+		for (auto &stream : streams) {
+			if (stream && stream->quit_request) {
+				delete stream;
+				stream = NULL;
+			}
+		}
+		streams.erase(std::remove(streams.begin(), streams.end(), (NetworkStream *) NULL), streams.end());
+		update_budgets();
+
+		// candidates : the first missing blocks of each stream within its readahead
+		// deadlines only grow with the block index, so no stream needs to offer more blocks than can be fetched at once
+		std::vector<BlockRequest> candidates;
+		for (auto stream : streams) {
+			if (stream->suspend_request || stream->error) continue;
+			if (!stream->ready) {
+				if ((int) new_streams.size() < MAX_PARALLEL_FIRST_BLOCKS) new_streams.push_back(stream);
+				continue;
+			}
+			uint64_t read_head_block = stream->read_head / BLOCK_SIZE;
+			std::vector<uint64_t> missing_blocks;
+			stream->downloaded_data_lock.lock();
+			for (uint64_t block = read_head_block; (int) missing_blocks.size() < connection_num && block < stream->block_num &&
+				block - read_head_block < stream->readahead_blocks; block++) {
+				if (!stream->blocks[block]) missing_blocks.push_back(block);
+			}
+			stream->downloaded_data_lock.unlock();
+			for (auto block : missing_blocks) candidates.push_back({stream, block, get_deadline(stream, block)});
+		}
+		streams_lock.unlock();
+		
+		if (new_streams.size()) { // streams that have just been added need their length first
+			fetch_first_blocks(new_streams);
+			continue;
+		}
+		if (!candidates.size()) {
+			sceKernelDelayThread(IDLE_INTERVAL);
+			continue;
+		}
+		// earliest deadline first, across streams
+		std::sort(candidates.begin(), candidates.end(), [] (const BlockRequest &a, const BlockRequest &b) { return a.deadline < b.deadline; });
+		if ((int) candidates.size() > connection_num) candidates.resize(connection_num);
+		// streams are only deleted on this thread, so they stay valid without holding streams_lock
+		fetch_blocks(candidates);
+	}
+	
+	streams_lock.lock();
+	for (auto &stream : streams) {
+		if (stream->quit_request) {
+			delete stream;
+			stream = NULL;
+		}
+	}
+	streams.erase(std::remove(streams.begin(), streams.end(), (NetworkStream *) NULL), streams.end());
+	thread_running = false;
+	streams_lock.unlock();
+}
+
+SceInt32 network_downloader_thread(SceSize args, void *argp) {
+	NetworkStreamDownloader *downloader = *(NetworkStreamDownloader **) argp;
+	downloader->downloader_thread();
+	return 0;
+}
@@ -0,0 +1,399 @@
+#include "network/network_fragment.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
+
+#define SOURCE_WAIT_INTERVAL 10000 // us
+#define MAX_INDEX_PARSE_SIZE 0x10000 // the boxes needed for the start time are at the beginning of a fragment
+
+static uint64_t read_be(const uint8_t *data, int size) {
+	uint64_t res = 0;
+	for (int i = 0; i < size; i++) res = res << 8 | data[i];
+	return res;
+}
+// finds the first box of `type` in [data, data + size), returns its payload through `payload` and `payload_size`
+static bool find_box(const uint8_t *data, uint64_t size, const char *type, const uint8_t **payload, uint64_t *payload_size) {
+	uint64_t pos = 0;
+	while (pos + 8 <= size) {
+		uint64_t box_size = read_be(data + pos, 4);
+		uint64_t header_size = 8;
+		if (box_size == 1) {
+			if (pos + 16 > size) return false;
+			box_size = read_be(data + pos + 8, 8);
+			header_size = 16;
+		} else if (box_size == 0) box_size = size - pos;
+		if (box_size < header_size) return false;
+		if (!memcmp(data + pos + 4, type, 4)) {
+			*payload = data + pos + header_size;
+			*payload_size = std::min(box_size, size - pos) - header_size; // may be cut off at the end of the parsed data
+			return true;
+		}
+		pos += box_size;
+	}
+	return false;
+}
+static bool find_box_path(const uint8_t *data, uint64_t size, const std::vector<const char *> &path, const uint8_t **payload, uint64_t *payload_size) {
+	for (auto type : path) {
+		if (!find_box(data, size, type, &data, &size)) return false;
+	}
+	*payload = data;
+	*payload_size = size;
+	return true;
+}
+// the decode time of the first sample of a self-initializing fragmented MP4 in seconds, -1 if not found
+static double get_fragment_start_time(const uint8_t *data, uint64_t size) {
+	const uint8_t *mdhd, *tfdt;
+	uint64_t mdhd_size, tfdt_size;
+	if (!find_box_path(data, size, {"moov", "trak", "mdia", "mdhd"}, &mdhd, &mdhd_size)) return -1;
+	if (!find_box_path(data, size, {"moof", "traf", "tfdt"}, &tfdt, &tfdt_size)) return -1;
+	// both are full boxes : version (1 byte) + flags (3 bytes) first
+	uint64_t timescale = 0, decode_time = 0;
+	if (mdhd_size >= 24 && mdhd[0] == 1) timescale = read_be(mdhd + 20, 4);
+	else if (mdhd_size >= 16 && mdhd[0] == 0) timescale = read_be(mdhd + 12, 4);
+	if (tfdt_size >= 12 && tfdt[0] == 1) decode_time = read_be(tfdt + 4, 8);
+	else if (tfdt_size >= 8 && tfdt[0] == 0) decode_time = read_be(tfdt + 4, 4);
+	else return -1;
+	if (!timescale) return -1;
+	return (double) decode_time / timescale;
+}
+
+
+void NetworkSegmentIndex::reset(double fragment_len) {
+	lock.lock();
+	segments.clear();
+	default_duration = fragment_len;
+	duration_sum = 0;
+	duration_num = 0;
+	seq_head = -1;
+	lock.unlock();
+}
+
+void NetworkSegmentIndex::add(int seq, double start_time) {
+	if (segments.count(seq)) return;
+	auto itr = segments.insert({seq, {start_time, 0}}).first;
+	// the durations of the neighbours become known if they are consecutive
+	if (itr != segments.begin()) {
+		auto prev = std::prev(itr);
+		if (prev->first == seq - 1 && start_time > prev->second.start_time) {
+			prev->second.duration = start_time - prev->second.start_time;
+			duration_sum += prev->second.duration;
+			duration_num++;
+		}
+	}
+	auto next = std::next(itr);
+	if (next != segments.end() && next->first == seq + 1 && next->second.start_time > start_time) {
+		itr->second.duration = next->second.start_time - start_time;
+		duration_sum += itr->second.duration;
+		duration_num++;
+	}
+}
+
+double NetworkSegmentIndex::get_average_duration() {
+	return duration_num ? duration_sum / duration_num : default_duration;
+}
+
+double NetworkSegmentIndex::estimate_start_time(int seq) {
+	if (!segments.size()) return -1;
+	auto itr = segments.lower_bound(seq);
+	if (itr != segments.end() && itr->first == seq) return itr->second.start_time;
+	// from the nearest known fragment (the previous one if there is one)
+	if (itr == segments.end() || itr != segments.begin()) itr = std::prev(itr);
+	return itr->second.start_time + (seq - itr->first) * get_average_duration();
+}
+
+void NetworkSegmentIndex::learn(int seq, NetworkStream *stream) {
+	double start_time = -1;
+	if (stream->ready && stream->len) {
+		std::vector<uint8_t> data(std::min<uint64_t>(stream->len, MAX_INDEX_PARSE_SIZE));
+		int read_size = stream->read_into(0, data.data(), data.size());
+		if (read_size > 0) start_time = get_fragment_start_time(data.data(), read_size);
+	}
+	lock.lock();
+	if (start_time >= 0) add(seq, start_time);
+	if (stream->seq_head >= 0 && stream->head_time >= 0) add(stream->seq_head, stream->head_time);
+	if (stream->seq_head > seq_head) seq_head = stream->seq_head;
+	lock.unlock();
+}
+
+double NetworkSegmentIndex::get_start_time(int seq) {
+	lock.lock();
+	double res = estimate_start_time(seq);
+	lock.unlock();
+	return res;
+}
+
+double NetworkSegmentIndex::get_end_time() {
+	lock.lock();
+	double res = -1;
+	if (segments.size()) {
+		int last_seq = std::max(seq_head, segments.rbegin()->first);
+		res = estimate_start_time(last_seq) + get_average_duration();
+	}
+	lock.unlock();
+	return res;
+}
+
+int NetworkSegmentIndex::find(double time) {
+	int res = -1;
+	lock.lock();
+	if (segments.size()) {
+		// start times increase with the sequence number, so the known fragments are sorted by both
+		auto itr = std::upper_bound(segments.begin(), segments.end(), time,
+			[] (double time, const std::pair<const int, Segment> &segment) { return time < segment.second.start_time; });
+		double duration = get_average_duration();
+		if (itr == segments.begin()) { // before the first known fragment
+			res = itr->first;
+			if (duration > 0) res -= (int) std::ceil((itr->second.start_time - time) / duration);
+		} else {
+			auto prev = std::prev(itr);
+			res = prev->first;
+			double offset = time - prev->second.start_time;
+			if (prev->second.duration) { // `time` is either in `prev` or in the gap after it
+				if (offset >= prev->second.duration) res = prev->first + 1 + (int) ((offset - prev->second.duration) / duration);
+			} else if (duration > 0) res = prev->first + (int) (offset / duration);
+			if (itr != segments.end()) res = std::min(res, itr->first - 1);
+		}
+		if (seq_head >= 0) res = std::min(res, seq_head);
+		res = std::max(res, 0);
+	}
+	lock.unlock();
+	return res;
+}
+
+void NetworkFragmentPrefetcher::init(NetworkStreamDownloader &downloader, const std::vector<std::string> &urls, double fragment_len) {
+	deinit();
+	segment_index.reset(fragment_len);
+	lock.lock();
+	this->downloader = &downloader;
+	this->urls = urls;
+	this->fragment_len = fragment_len;
+	seq_head = -1;
+	seq_using = -1;
+	lock.unlock();
+}
+
+void NetworkFragmentPrefetcher::deinit() {
+	lock.lock();
+	for (auto &fragment : fragments) release(fragment.second);
+	fragments.clear();
+	downloader = NULL;
+	lock.unlock();
+}
+
+void NetworkFragmentPrefetcher::request(int seq, bool prefetch) {
+	Fragment &fragment = fragments[seq];
+	fragment.request_time = sceKernelGetProcessTimeWide();
+	for (auto &url : urls) {
+		NetworkStream *stream = new NetworkStream(url + "&sq=" + std::to_string(seq), true);
+		stream->prefetch = prefetch;
+		fragment.streams.push_back(stream);
+		downloader->add_stream(stream);
+	}
+}
+
+void NetworkFragmentPrefetcher::release(Fragment &fragment) {
+	for (auto stream : fragment.streams) if (stream) stream->quit_request = true;
+	fragment.streams.clear();
+}
+
+void NetworkFragmentPrefetcher::update_measurements() {
+	std::vector<int> failed_fragments;
+	for (auto &fragment : fragments) {
+		bool ready = true;
+		bool failed = false;
+		for (auto stream : fragment.second.streams) {
+			if (!stream) continue;
+			if (stream->error) failed = true;
+			if (!stream->ready) ready = false;
+			else if (stream->seq_head > seq_head) seq_head = stream->seq_head;
+		}
+		if (failed) failed_fragments.push_back(fragment.first);
+		else if (ready && !fragment.second.measured) {
+			fragment.second.measured = true;
+			for (auto stream : fragment.second.streams) if (stream) {
+				segment_index.learn(fragment.first, stream);
+				break;
+			}
+			double cur_fetch_time = (sceKernelGetProcessTimeWide() - fragment.second.request_time) / 1000000.0;
+			fetch_time = fetch_time ? fetch_time * 0.75 + cur_fetch_time * 0.25 : cur_fetch_time;
+		}
+	}
+	// a fragment may fail because it is not available yet : it is requested again on a later update
+	for (auto seq : failed_fragments) {
+		release(fragments[seq]);
+		fragments.erase(seq);
+	}
+}
+
+int NetworkFragmentPrefetcher::get_prefetch_num() {
+	if (fragment_len <= 0 || !fetch_time) return 1;
+	int res = (int) std::ceil(fetch_time * FETCH_TIME_MARGIN / fragment_len) + 1;
+	return std::max(1, std::min(res, (int) MAX_PREFETCH_FRAGMENTS)); // a copy : the constant has no out-of-class definition
+}
+
+void NetworkFragmentPrefetcher::update(int seq) {
+	lock.lock();
+	if (!downloader) {
+		lock.unlock();
+		return;
+	}
+	seq_using = seq;
+	update_measurements();
+	while (fragments.size() && fragments.begin()->first < seq) {
+		release(fragments.begin()->second);
+		fragments.erase(fragments.begin());
+	}
+	int prefetch_num = get_prefetch_num();
+	for (int i = 1; i <= prefetch_num; i++) {
+		if (seq_head != -1 && seq + i > seq_head) break;
+		// fragments past the one right after the playhead must not take bandwidth from playback
+		if (!fragments.count(seq + i)) request(seq + i, i > 1);
+	}
+	lock.unlock();
+}
+
+std::vector<NetworkStream *> NetworkFragmentPrefetcher::take(int seq) {
+	std::vector<NetworkStream *> res;
+	for (int i = 0; i < (int) urls.size(); i++) res.push_back(take(seq, i));
+	return res;
+}
+
+NetworkStream *NetworkFragmentPrefetcher::take(int seq, int url_index) {
+	NetworkStream *res = NULL;
+	lock.lock();
+	if (downloader && url_index >= 0 && url_index < (int) urls.size()) {
+		// a stream taken before (by a previous take() of the same fragment) is requested again
+		if (fragments.count(seq) && !fragments[seq].streams[url_index]) {
+			release(fragments[seq]);
+			fragments.erase(seq);
+		}
+		if (!fragments.count(seq)) request(seq, false);
+		Fragment &fragment = fragments[seq];
+		std::swap(res, fragment.streams[url_index]);
+		res->prefetch = false;
+		if (std::count(fragment.streams.begin(), fragment.streams.end(), (NetworkStream *) NULL) == (int) fragment.streams.size())
+			fragments.erase(seq);
+	}
+	lock.unlock();
+	return res;
+}
+
+
+void NetworkFragmentSource::init(NetworkFragmentPrefetcher &prefetcher, int url_index, int first_seq) {
+	deinit();
+	this->prefetcher = &prefetcher;
+	this->url_index = url_index;
+	quit_request = false;
+	read_pos = 0;
+	cur_seq = first_seq - 1;
+}
+
+void NetworkFragmentSource::deinit() {
+	if (cur_stream) cur_stream->quit_request = true;
+	cur_stream = NULL;
+	prefetcher = NULL;
+	boundaries_lock.lock();
+	boundaries.clear();
+	boundaries_lock.unlock();
+}
+
+// reads exactly `size` bytes at `offset`, waiting for them to be downloaded
+static bool read_exact(NetworkStream *stream, uint64_t offset, uint8_t *buf, int size, volatile bool &quit_request) {
+	int res = 0;
+	while (res < size) {
+		if (quit_request || stream->quit_request || stream->error) return false;
+		int read_size = stream->read_into(offset + res, buf + res, size - res);
+		if (read_size < 0) return false;
+		if (read_size == 0) sceKernelDelayThread(SOURCE_WAIT_INTERVAL);
+		res += read_size;
+	}
+	return true;
+}
+
+bool NetworkFragmentSource::skip_headers(NetworkStream *stream) {
+	uint64_t pos = 0;
+	while (1) {
+		uint8_t header[16];
+		if (!read_exact(stream, pos, header, 8, quit_request)) return false;
+		if (memcmp(header + 4, "ftyp", 4) && memcmp(header + 4, "moov", 4)) break;
+		uint64_t box_size = (uint64_t) header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+		if (box_size == 1) { // 64-bit size follows the type
+			if (!read_exact(stream, pos + 8, header + 8, 8, quit_request)) return false;
+			box_size = 0;
+			for (int i = 8; i < 16; i++) box_size = box_size << 8 | header[i];
+		}
+		if (box_size < 8) return false; // 0 ("to the end of the file") or broken : nothing of the fragment would be left
+		pos += box_size;
+	}
+	stream->read_head = pos;
+	return true;
+}
+
+bool NetworkFragmentSource::open_fragment(int seq) {
+	for (int retry = 0; retry < MAX_FRAGMENT_RETRY && !quit_request; retry++) {
+		if (retry) sceKernelDelayThread(RETRY_INTERVAL);
+		if (url_index == 0) prefetcher->update(seq); // one of the sources of a fragment is enough to move the prefetch window
+		NetworkStream *stream = prefetcher->take(seq, url_index);
+		if (!stream) return false;
+		
+		bool ok = true;
+		if (boundaries.size()) ok = skip_headers(stream);
+		else { // the first fragment is read as it is, only wait for it to become available to tell whether it failed
+			while (!stream->ready && !stream->error && !quit_request) sceKernelDelayThread(SOURCE_WAIT_INTERVAL);
+			ok = stream->ready;
+		}
+		if (!ok) {
+			stream->quit_request = true;
+			continue;
+		}
+		if (cur_stream) cur_stream->quit_request = true;
+		cur_stream = stream;
+		cur_seq = seq;
+		prefetcher->get_segment_index().learn(seq, stream);
+		boundaries_lock.lock();
+		boundaries.push_back({read_pos, seq});
+		boundaries_lock.unlock();
+		return true;
+	}
+	return false;
+}
+
+int NetworkFragmentSource::read(uint8_t *buf, int buf_size) {
+	if (!prefetcher) return NETWORK_STREAM_AVERROR_EOF;
+	while (1) {
+		if (quit_request) return NETWORK_STREAM_AVERROR_EOF;
+		if (cur_stream) { // as network_stream_avio_read(), but also stopped by our quit_request
+			if (cur_stream->error) return NETWORK_STREAM_AVERROR_EIO;
+			int res = cur_stream->read_into(cur_stream->read_head, buf, buf_size);
+			if (res > 0) {
+				cur_stream->network_waiting_status = NULL;
+				cur_stream->read_head += res;
+				read_pos += res;
+				return res;
+			}
+			if (res == 0) {
+				cur_stream->network_waiting_status = "Reading stream";
+				sceKernelDelayThread(SOURCE_WAIT_INTERVAL);
+				continue;
+			}
+		}
+		// the end of the current fragment : continue with the next one
+		// a next fragment that keeps failing is the end of the livestream, only failing to open the first one is an error
+		if (!open_fragment(cur_seq + 1)) return quit_request || boundaries.size() ? NETWORK_STREAM_AVERROR_EOF : NETWORK_STREAM_AVERROR_EIO;
+	}
+}
+
+int NetworkFragmentSource::get_seq_at(uint64_t offset) {
+	int res = -1;
+	boundaries_lock.lock();
+	auto itr = std::upper_bound(boundaries.begin(), boundaries.end(), std::make_pair(offset, std::numeric_limits<int>::max()));
+	if (itr != boundaries.begin()) res = std::prev(itr)->second;
+	boundaries_lock.unlock();
+	return res;
+}
+
+int network_fragment_avio_read(void *opaque, uint8_t *buf, int buf_size) {
+	return ((NetworkFragmentSource *) opaque)->read(buf, buf_size);
+}
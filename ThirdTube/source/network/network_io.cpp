@@ -1,8 +1,14 @@
 #include "headers.hpp"
 #include "network/network_io.hpp"
+#include "network/network_capture.hpp"
+#include "network/network_stats.hpp"
+#include "network/network_cache.hpp"
+#include "network/network_scheduler.hpp"
+#include "network/network_range.hpp"
 #include <cassert>
+#include <algorithm>
+#include <memory>
 #include <cctype>
-#include <deque>
 #include <stdio.h>
 
 #include <libhttp.h>
@@ -37,6 +43,15 @@ std::string url_get_host_name(const std::string &url) {
 	pos0 += 3;
 	return std::string(url.begin() + pos0, std::find(url.begin() + pos0, url.end(), '/'));
 }
+std::string url_get_param(const std::string &url, const std::string &name) {
+	for (size_t pos = url.find('?'); pos != std::string::npos; pos = url.find('&', pos + 1)) {
+		if (url.compare(pos + 1, name.size() + 1, name + "=")) continue;
+		size_t start = pos + name.size() + 2;
+		size_t end = url.find('&', start);
+		return url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+	}
+	return "";
+}
 static std::string get_page_url(const std::string &url) {
 	auto pos0 = url.find("://");
 	if (pos0 == std::string::npos) return "";
@@ -45,139 +60,112 @@ static std::string get_page_url(const std::string &url) {
 	if (res == "") res = "/";
 	return res;
 }
-static std::string remove_leading_whitespaces(std::string str) {
-	size_t i = 0;
-	while (i < str.size() && str[i] == ' ') i++;
-	return str.substr(i, str.size() - i);
-}
-
-struct ResponseHeader {
-	int status_code = -1;
-	std::string status_message;
-	std::map<std::string, std::string> headers;
-};
-static ResponseHeader parse_header(std::string header) {
-	ResponseHeader res;
-	std::vector<std::string> header_lines;
-	{
-		std::vector<std::string> header_lines_tmp = {""};
-		for (auto c : header) {
-			if (c == '\n') header_lines_tmp.push_back("");
-			else header_lines_tmp.back().push_back(c);
-		}	
-		for (auto line : header_lines_tmp) {
-			if (line.size() && line.back() == '\r') line.pop_back();
-			if (!line.size()) continue;
-			header_lines.push_back(line);
-		}
-	}
-	// parse status line
-	{
-		if (!header_lines.size()) {
-			//sceClibPrintf("http, Empty header");
-			return res;
-		}
-		const std::string &status_line = header_lines[0];
-		if (status_line.substr(0, 8) != "HTTP/1.1" && status_line.substr(0, 8) != "HTTP/1.0") {
-			//sceClibPrintf("http, Invalid status line");
-			return res;
-		}
-		size_t head = 8;
-		while (head < status_line.size() && std::isspace(status_line[head])) head++;
-		char *end;
-		res.status_code = strtol(status_line.c_str() + head, &end, 10);
-		if (end == status_line.c_str() + head) {
-			//sceClibPrintf("http, failed to parse status code in the status line");
-			res.status_code = -1;
-			return res;
-		}
-		head = end - status_line.c_str();
-		while (head < status_line.size() && std::isspace(status_line[head])) head++;
-		res.status_message = status_line.c_str() + head;
-		header_lines.erase(header_lines.begin());
-	}
-	for (auto line : header_lines) {
-		auto colon = std::find(line.begin(), line.end(), ':');
-		if (colon == line.end()) {
-			//sceClibPrintf("http, Header line without a colon, ignoring");
-			continue;
-		}
-		auto key = remove_leading_whitespaces(std::string(line.begin(), colon));
-		auto value = remove_leading_whitespaces(std::string(colon + 1, line.end()));
-		res.headers[key] = value;
-	}
-	return res;
-}
+/*
+	incremental decoder of 'Transfer-Encoding: chunked' bodies
+	input can be split at arbitrary positions; the payload is appended directly to `out` in one copy per span
+	and nothing is buffered inside the decoder
+	not used at the moment : libhttp already de-chunks the bodies it returns, this is kept for a raw socket read path
+*/
 struct ChunkProcessor {
-	std::string result;
-	std::deque<char> buffer;
-	int size = -1;
-	int size_size = -1;
-	bool error = false;
-	
-	int parse_hex(std::string str) {
-		int res = 0;
-		for (auto c : str) {
-			res *= 16;
-			if (std::isdigit(c)) res += c - '0';
-			else if (c >= 'A' && c <= 'F') res += c - 'A' + 10;
-			else if (c >= 'a' && c <= 'f') res += c - 'a' + 10;
-			else {
-				//sceClibPrintf("hex", "unexpected char");
-				error = true;
-				return -1;
-			}
-		}
-		return res;
-	}
-	void try_to_parse_size() {
-		size_t pos = 0;
-		for (; pos + 1 < buffer.size(); pos++) if (buffer[pos] == '\r' && buffer[pos + 1] == '\n') break;
-		if (pos + 1 >= buffer.size()) size = size_size = -1;
-		else {
-			size_size = pos;
-			size = parse_hex(std::string(buffer.begin(), buffer.begin() + size_size));
-		}
-	}
+	enum class State {
+		SIZE,
+		SIZE_EXTENSION,
+		SIZE_LF,
+		DATA,
+		DATA_CR,
+		DATA_LF,
+		TRAILER,
+		TRAILER_LF,
+		END,
+		ERROR
+	};
+	State state = State::SIZE;
+	uint64_t remaining = 0; // the chunk size being parsed, then the payload bytes left in the current chunk
+	bool size_has_digit = false;
+	bool trailer_line_empty = true;
 	
 	// -1 : error
 	// 0 : not the end
 	// 1 : end reached
-	template<class T> int push(const T &str) {
-		buffer.insert(buffer.end(), str.begin(), str.end());
-		if (size == -1) {
-			try_to_parse_size();
-			if (error) return -1;
-			if (size == -1) return 0;
-		}
-		while ((int) buffer.size() >= size_size + 2 + size + 2) {
-			{
-				auto tmp = std::string(buffer.begin() + size_size + 2 + size, buffer.begin() + size_size + 2 + size + 2);
-				if (tmp != "\r\n") {
-					Util_log_save("http-chunk", "expected \\r\\n after chunk content end : " + std::to_string(tmp[0]) + " " + std::to_string(tmp[1]));
-					return -1;
-				}
+	int push(const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+	template<class T> int push(const T &str, std::vector<uint8_t> &out) { return push((const uint8_t *) str.data(), str.size(), out); }
+};
+int ChunkProcessor::push(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+	const uint8_t *cur = data;
+	const uint8_t *end = data + size;
+	while (cur < end) {
+		switch (state) {
+			case State::SIZE : {
+				uint8_t c = *cur;
+				int digit = -1;
+				if (c >= '0' && c <= '9') digit = c - '0';
+				else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+				else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+				if (digit != -1) {
+					if (remaining >> 56) state = State::ERROR; // absurdly large chunk
+					else remaining = remaining << 4 | digit;
+					size_has_digit = true;
+					cur++;
+				} else if (!size_has_digit) state = State::ERROR;
+				else if (c == ';' || c == ' ' || c == '\t') state = State::SIZE_EXTENSION, cur++;
+				else if (c == '\r') state = State::SIZE_LF, cur++;
+				else state = State::ERROR;
+				break;
 			}
-			result.insert(result.end(), buffer.begin() + size_size + 2, buffer.begin() + size_size + 2 + size);
-			buffer.erase(buffer.begin(), buffer.begin() + size_size + 2 + size + 2);
-			// Util_log_save("http-chunk", "read chunk size : " + std::to_string(size));
-			if (size == 0) {
-				if (buffer.size()) {
-					Util_log_save("http-chunk", "trailing data : " + std::string(buffer.begin(), buffer.end()));
-					return -1;
-				}
-				return 1;
+			case State::SIZE_EXTENSION : {
+				// chunk extensions are ignored
+				const uint8_t *cr = (const uint8_t *) memchr(cur, '\r', end - cur);
+				if (!cr) cur = end;
+				else state = State::SIZE_LF, cur = cr + 1;
+				break;
 			}
-			try_to_parse_size();
-			if (error) return -1;
-			if (size == -1) break;
+			case State::SIZE_LF :
+				if (*cur++ != '\n') state = State::ERROR;
+				else if (remaining) state = State::DATA;
+				else state = State::TRAILER, trailer_line_empty = true;
+				break;
+			case State::DATA : {
+				// the only place payload bytes are touched : one bulk copy per span
+				size_t copy_size = std::min<uint64_t>(remaining, end - cur);
+				out.insert(out.end(), cur, cur + copy_size);
+				cur += copy_size;
+				remaining -= copy_size;
+				if (!remaining) state = State::DATA_CR;
+				break;
+			}
+			case State::DATA_CR :
+				state = *cur++ == '\r' ? State::DATA_LF : State::ERROR;
+				break;
+			case State::DATA_LF :
+				if (*cur++ != '\n') state = State::ERROR;
+				else state = State::SIZE, remaining = 0, size_has_digit = false;
+				break;
+			case State::TRAILER : {
+				// trailer fields are ignored; an empty line ends the body
+				uint8_t c = *cur++;
+				if (c == '\r') state = State::TRAILER_LF;
+				else trailer_line_empty = false;
+				break;
+			}
+			case State::TRAILER_LF :
+				if (*cur++ != '\n') state = State::ERROR;
+				else if (trailer_line_empty) state = State::END;
+				else state = State::TRAILER, trailer_line_empty = true;
+				break;
+			case State::END : // trailing data
+			case State::ERROR :
+				state = State::ERROR;
+				return -1;
 		}
-		return 0;
 	}
-};
+	if (state == State::ERROR) return -1;
+	return state == State::END ? 1 : 0;
+}
+
+static NetworkMutex request_control_lock("request_control_lock");
 
 static NetworkResult access_http_internal(const std::string &method, const std::string &url,
-	std::map<std::string, std::string> request_headers, const std::string &body, bool follow_redirect) {
+	std::map<std::string, std::string> request_headers, const std::string &body, bool follow_redirect, NetworkRequestControl *control) {
 
 	NetworkResult res;
 
@@ -197,9 +185,35 @@ static NetworkResult access_http_internal(const std::string &method, const std::
 	uint8_t *buffer = new uint8_t[0x1000];
 
 	for (auto header : default_headers) if (!request_headers.count(header.first)) request_headers[header.first] = header.second;
+	
+	SceUInt64 start_time = sceKernelGetProcessTimeWide();
+	if (network_replay_lookup(method, url, request_headers, body, res)) {
+		delete buffer;
+		res.timing.total = sceKernelGetProcessTimeWide() - start_time;
+		res.timing.bytes_received = res.data.size();
+		return res;
+	}
+	NetworkTrafficClass traffic_class = control && control->traffic_class != NetworkTrafficClass::AUTO ?
+		control->traffic_class : network_scheduler_classify(url);
+	if (!network_scheduler_acquire(traffic_class, control ? &control->abort_request : NULL)) {
+		delete buffer;
+		res.fail = true;
+		res.error = "aborted";
+		res.timing.total = res.timing.queue = sceKernelGetProcessTimeWide() - start_time;
+		return res;
+	}
+	if (control) control->admit_time = sceKernelGetProcessTimeWide();
 	{
 		SceInt32 ret = 0;
 		SceInt32 status_code = 0;
+		SceUInt64 phase_start = sceKernelGetProcessTimeWide();
+		res.timing.queue = phase_start - start_time;
+		auto end_phase = [&] (SceUInt64 &phase) {
+			SceUInt64 cur_time = sceKernelGetProcessTimeWide();
+			phase = cur_time - phase_start;
+			phase_start = cur_time;
+		};
+		
 		if (g_httpTemplate >= 0) {
 			res.templateId = g_httpTemplate;
 		}
@@ -211,25 +225,50 @@ static NetworkResult access_http_internal(const std::string &method, const std::
 		for (auto i : request_headers) sceHttpAddRequestHeader(res.connectionId, i.first.c_str(), i.second.c_str(), SCE_HTTP_HEADER_OVERWRITE);
 
 		res.requestId = sceHttpCreateRequestWithURL(res.connectionId, method == "GET" ? SCE_HTTP_METHOD_GET : SCE_HTTP_METHOD_POST, url.c_str(), method == "GET" ? 0 : body.size());
+		end_phase(res.timing.setup);
+		if (control) {
+			request_control_lock.lock();
+			control->request_id = res.requestId;
+			request_control_lock.unlock();
+		}
+		auto detach_control = [&] () {
+			if (!control) return;
+			request_control_lock.lock();
+			control->request_id = -1;
+			request_control_lock.unlock();
+		};
 
 		if (method == "POST") {
 			sceHttpSendRequest(res.requestId, body.c_str(), body.size());
+			res.timing.bytes_sent = body.size();
 		}
 		else {
 			sceHttpSendRequest(res.requestId, NULL, 0);
 		}
+		end_phase(res.timing.send);
 
 		ret = sceHttpGetStatusCode(res.requestId, &status_code);
 
-		if (ret != 0) {
+		if (ret != 0 || (control && control->abort_request)) {
 			res.fail = true;
-			res.error = "sceHttpGetStatusCode() failed";
+			res.error = control && control->abort_request ? "aborted" : "sceHttpGetStatusCode() failed";
+			detach_control();
+			network_scheduler_release(traffic_class);
 			delete buffer;
+			end_phase(res.timing.response);
+			res.timing.total = sceKernelGetProcessTimeWide() - start_time;
+			network_capture_record(method, url, request_headers, body, res, start_time, res.timing.total);
 			return res;
 		}
 		res.status_code = status_code;
 
-		sceHttpGetAllResponseHeaders(res.requestId, &res.responseHeaders, &res.responseHeadersLen);
+		{
+			char *headers = NULL;
+			SceSize headers_len = 0;
+			if (sceHttpGetAllResponseHeaders(res.requestId, &headers, &headers_len) == 0 && headers) res.set_response_headers(headers, headers_len);
+		}
+		end_phase(res.timing.response);
+		if (control) control->last_progress_time = sceKernelGetProcessTimeWide();
 
 		SceInt32 len_read = 0;
 
@@ -237,54 +276,344 @@ static NetworkResult access_http_internal(const std::string &method, const std::
 			len_read = sceHttpReadData(res.requestId, buffer, 0x1000);
 			if (len_read <= 0) break;
 			res.data.insert(res.data.end(), buffer, buffer + len_read);
+			if (control) {
+				control->bytes_received += len_read;
+				control->last_progress_time = sceKernelGetProcessTimeWide();
+			}
+			network_scheduler_throttle(traffic_class, len_read, control ? &control->abort_request : NULL);
 		}
-
+		detach_control();
+		if (control && control->abort_request) {
+			res.fail = true;
+			res.error = "aborted";
+		}
+		end_phase(res.timing.transfer);
+		res.timing.bytes_received = res.response_headers.size() + res.data.size();
 	}
+	network_scheduler_release(traffic_class);
 
 	delete buffer;
 	
+	res.timing.total = sceKernelGetProcessTimeWide() - start_time;
+	network_capture_record(method, url, request_headers, body, res, start_time, res.timing.total);
 	return res;
 }
-NetworkResult Access_http_get(std::string url, const std::map<std::string, std::string> &request_headers, bool follow_redirect) {
+static NetworkResult access_http_get_follow(std::string url, const std::map<std::string, std::string> &request_headers, bool follow_redirect,
+	NetworkRequestControl *control) {
+	
 	NetworkResult result;
+	const std::string original_url = url;
+	SceUInt64 redirect_time = 0;
+	int redirect_count = 0;
 	while (1) {
-		result = access_http_internal("GET", url , request_headers, "", follow_redirect);
-		if (result.status_code / 100 != 3) {
+		result = access_http_internal("GET", url , request_headers, "", follow_redirect, control);
+		result.timing.redirect = redirect_time;
+		result.timing.redirect_count = redirect_count;
+		result.timing.total += redirect_time;
+		if (result.status_code / 100 != 3 || result.fail) {
 			result.redirected_url = url;
+			network_stats_record(original_url, result.timing, result.fail);
 			return result;
 		}
 		//sceClibPrintf("http, redir");
 		if (!follow_redirect) {
 			result.redirected_url = result.get_header("Location");
+			network_stats_record(original_url, result.timing, result.fail);
 			return result;
 		}
 		auto new_url = result.get_header("Location");
+		redirect_time = result.timing.total;
+		redirect_count++;
 
 		result.finalize();
 		url = new_url;
 	}
 }
+
+/*
+	single-flight : identical GETs issued while one is already in progress wait for it instead of downloading again
+	requests are identical if their normalized url, request headers and redirect policy are the same
+	the transfer runs on a thread of its own, so each caller (including the one that started it) can give up on its own
+*/
+#define IN_FLIGHT_THREAD_STACK_SIZE 0x10000
+
+struct InFlightRequest {
+	std::string key;
+	std::string url;
+	std::map<std::string, std::string> request_headers;
+	bool follow_redirect = true;
+	int ref_num = 0; // the transfer thread and the callers that still hold a pointer to this instance
+	int waiter_num = 0; // callers that have not given up on the result
+	bool done = false;
+	std::vector<SceUID> wake_events; // one per waiting caller, set when the result is ready
+	NetworkRequestControl transfer_control; // control of the actual transfer, aborted when waiter_num hits zero
+	std::shared_ptr<NetworkResult> result;
+};
+static NetworkMutex in_flight_lock("in_flight_lock");
+static std::map<std::string, InFlightRequest *> in_flight_requests;
+
+std::string network_get_request_key(const std::string &url, const std::map<std::string, std::string> &request_headers, bool follow_redirect) {
+	std::string res;
+	// scheme and host are case-insensitive, the fragment is never sent
+	auto host_start = url.find("://");
+	size_t host_end = host_start == std::string::npos ? 0 : url.find_first_of("/?#", host_start + 3);
+	if (host_end == std::string::npos) host_end = url.size();
+	for (size_t i = 0; i < host_end; i++) res.push_back(std::tolower(url[i]));
+	res.append(url, host_end, url.find('#', host_end) - host_end);
+	
+	res += follow_redirect ? "\n1\n" : "\n0\n";
+	for (auto &header : request_headers) res += header.first + ": " + header.second + "\n";
+	return res;
+}
+// must be called with in_flight_lock held
+static void release_in_flight(InFlightRequest *flight) {
+	if (--flight->ref_num) return;
+	delete flight;
+}
+// must be called with in_flight_lock held; later identical requests start a new transfer
+static void unlist_in_flight(InFlightRequest *flight) {
+	auto itr = in_flight_requests.find(flight->key);
+	if (itr != in_flight_requests.end() && itr->second == flight) in_flight_requests.erase(itr);
+}
+
+static void abort_transfer(NetworkRequestControl *control) {
+	control->abort_request = true;
+	request_control_lock.lock();
+	if (control->request_id >= 0) sceHttpAbortRequest(control->request_id);
+	request_control_lock.unlock();
+}
+void NetworkRequestControl::abort() {
+	// set before looking at `flight` so that a caller which is about to wait sees it
+	abort_request = true;
+	in_flight_lock.lock();
+	if (flight) {
+		// give up our share of the transfer; only the last one actually aborts it
+		if (!--flight->waiter_num) {
+			unlist_in_flight(flight);
+			abort_transfer(&flight->transfer_control);
+		}
+		flight = NULL;
+		sceKernelSetEventFlag(wake_event, 1);
+	}
+	in_flight_lock.unlock();
+	network_range_abort(this);
+	abort_transfer(this);
+}
+
+static SceInt32 in_flight_thread(SceSize args, void *argp) {
+	InFlightRequest *flight = *(InFlightRequest **) argp;
+	
+	std::shared_ptr<NetworkResult> result = std::make_shared<NetworkResult>();
+	std::map<std::string, std::string> actual_headers = flight->request_headers;
+	// only final responses are cached, so requests that stop at a redirect bypass the cache
+	if (!flight->follow_redirect || !network_cache_lookup(flight->url, flight->request_headers, *result, actual_headers)) {
+		*result = access_http_get_follow(flight->url, actual_headers, flight->follow_redirect, &flight->transfer_control);
+		if (flight->follow_redirect && !network_cache_update(flight->url, flight->request_headers, *result)) {
+			// the entry the 304 refers to was evicted meanwhile : ask for the full response instead
+			*result = access_http_get_follow(flight->url, flight->request_headers, true, &flight->transfer_control);
+			network_cache_update(flight->url, flight->request_headers, *result);
+		}
+	}
+	// the body has been fully read, so the libhttp objects are not needed by anyone sharing the result
+	result->finalize();
+	
+	in_flight_lock.lock();
+	unlist_in_flight(flight);
+	flight->result = result;
+	flight->done = true;
+	for (auto event : flight->wake_events) sceKernelSetEventFlag(event, 1);
+	release_in_flight(flight);
+	in_flight_lock.unlock();
+	
+	return sceKernelExitDeleteThread(0);
+}
+
+static std::shared_ptr<NetworkResult> access_http_get_coalesced(const std::string &url, const std::map<std::string, std::string> &request_headers,
+	bool follow_redirect, NetworkRequestControl *control) {
+	
+	auto key = network_get_request_key(url, request_headers, follow_redirect);
+	SceUID wake_event = sceKernelCreateEventFlag("in_flight_wait", 0, 0, NULL);
+	
+	in_flight_lock.lock();
+	InFlightRequest *flight;
+	auto itr = in_flight_requests.find(key);
+	if (itr != in_flight_requests.end()) flight = itr->second;
+	else {
+		flight = new InFlightRequest();
+		flight->key = key;
+		flight->url = url;
+		flight->request_headers = request_headers;
+		flight->follow_redirect = follow_redirect;
+		if (control) flight->transfer_control.traffic_class = control->traffic_class;
+		SceUID thread = sceKernelCreateThread("in_flight_transfer", in_flight_thread, SCE_KERNEL_DEFAULT_PRIORITY_USER, IN_FLIGHT_THREAD_STACK_SIZE, 0, 0, NULL);
+		if (thread >= 0 && sceKernelStartThread(thread, sizeof(flight), &flight) >= 0) {
+			flight->ref_num++; // released by the thread
+			in_flight_requests[key] = flight;
+		} else {
+			if (thread >= 0) sceKernelDeleteThread(thread);
+			flight->result = std::make_shared<NetworkResult>();
+			flight->result->fail = true;
+			flight->result->error = "failed to start a transfer thread";
+			flight->done = true;
+		}
+	}
+	flight->ref_num++;
+	flight->waiter_num++;
+	flight->wake_events.push_back(wake_event);
+	bool done = flight->done;
+	if (control) {
+		control->flight = flight;
+		control->wake_event = wake_event;
+	}
+	in_flight_lock.unlock();
+	
+	if (!done && !(control && control->abort_request)) sceKernelWaitEventFlag(wake_event, 1, SCE_KERNEL_EVF_WAITMODE_OR, NULL, NULL);
+	
+	std::shared_ptr<NetworkResult> result;
+	in_flight_lock.lock();
+	if (flight->done && !(control && control->abort_request)) result = flight->result;
+	if ((!control || control->flight == flight) && !--flight->waiter_num && !flight->done) {
+		unlist_in_flight(flight);
+		abort_transfer(&flight->transfer_control);
+	}
+	if (control) {
+		control->flight = NULL;
+		control->wake_event = -1;
+	}
+	flight->wake_events.erase(std::find(flight->wake_events.begin(), flight->wake_events.end(), wake_event));
+	release_in_flight(flight);
+	in_flight_lock.unlock();
+	sceKernelDeleteEventFlag(wake_event);
+	
+	if (!result) {
+		result = std::make_shared<NetworkResult>();
+		result->fail = true;
+		result->error = "aborted";
+	}
+	return result;
+}
+
+std::shared_ptr<const NetworkResult> Access_http_get_shared(const std::string &url, const std::map<std::string, std::string> &request_headers,
+	bool follow_redirect, NetworkRequestControl *control) {
+	
+	if (control && !control->coalesce) {
+		auto result = std::make_shared<NetworkResult>(access_http_get_follow(url, request_headers, follow_redirect, control));
+		result->finalize();
+		return result;
+	}
+	return access_http_get_coalesced(url, request_headers, follow_redirect, control);
+}
+NetworkResult Access_http_get(std::string url, const std::map<std::string, std::string> &request_headers, bool follow_redirect,
+	NetworkRequestControl *control) {
+	
+	if (control && !control->coalesce) return access_http_get_follow(url, request_headers, follow_redirect, control);
+	
+	auto result = access_http_get_coalesced(url, request_headers, follow_redirect, control);
+	// nobody else can reach the result once its flight is gone, so the last holder takes it without copying the body
+	if (result.use_count() == 1) return std::move(*result);
+	return *result;
+}
 NetworkResult Access_http_post(const std::string &url, const std::map<std::string, std::string> &request_headers,
-	const std::string &data) {
+	const std::string &data, NetworkRequestControl *control) {
 	
-	auto result = access_http_internal("POST", url , request_headers, data, false);
+	auto result = access_http_internal("POST", url , request_headers, data, false, control);
 	result.redirected_url = url;
+	network_stats_record(url, result.timing, result.fail);
 	return result;
 }
 void NetworkResult::finalize () {
-	sceHttpDeleteRequest(this->requestId);
-	sceHttpDeleteConnection(this->connectionId);
+	if (this->requestId >= 0) sceHttpDeleteRequest(this->requestId);
+	if (this->connectionId >= 0) sceHttpDeleteConnection(this->connectionId);
+	this->requestId = this->connectionId = -1;
 }
 
-std::string NetworkResult::get_header(std::string key) {
-	char buffer[0x1000] = { 0 };
-	char *bufPtr = &buffer[0];
-	SceSize resLen = 0;
-
-	sceHttpParseResponseHeader(this->responseHeaders, this->responseHeadersLen, key.c_str(), &bufPtr, &resLen);
-
-	return std::string(buffer);
+static uint32_t header_key_hash(const char *key, size_t len) {
+	uint32_t res = 2166136261U; // FNV-1a over the lower-cased key
+	for (size_t i = 0; i < len; i++) res = (res ^ (uint8_t) std::tolower(key[i])) * 16777619U;
+	return res;
+}
+static bool header_key_equal(const char *a, const char *b, size_t len) {
+	for (size_t i = 0; i < len; i++) if (std::tolower(a[i]) != std::tolower(b[i])) return false;
+	return true;
 }
 
+void NetworkResult::set_response_headers(const char *headers, size_t len) {
+	response_headers.assign(headers, len);
+	header_index.clear();
+	
+	// collect the header lines
+	std::vector<HeaderSlot> slots;
+	const char *begin = response_headers.c_str();
+	for (size_t head = 0; head < len; ) {
+		size_t line_end = head;
+		while (line_end < len && begin[line_end] != '\n') line_end++;
+		size_t line_len = line_end - head;
+		if (line_len && begin[head + line_len - 1] == '\r') line_len--;
+		const char *line = begin + head;
+		
+		const char *colon = (const char *) memchr(line, ':', line_len);
+		if (colon && colon != line) {
+			HeaderSlot slot;
+			slot.key_pos = head;
+			slot.key_len = colon - line;
+			while (slot.key_len && line[slot.key_len - 1] == ' ') slot.key_len--;
+			size_t value_pos = colon + 1 - begin;
+			size_t value_end = head + line_len;
+			while (value_pos < value_end && (begin[value_pos] == ' ' || begin[value_pos] == '\t')) value_pos++;
+			while (value_end > value_pos && (begin[value_end - 1] == ' ' || begin[value_end - 1] == '\t')) value_end--;
+			slot.value_pos = value_pos;
+			slot.value_len = value_end - value_pos;
+			slot.hash = header_key_hash(line, slot.key_len);
+			slots.push_back(slot);
+		} else if (!colon && head == 0 && line_len > 9 && !memcmp(line, "HTTP/", 5)) { // status line
+			const char *message = (const char *) memchr(line + 9, ' ', line_len - 9);
+			if (message) status_message.assign(message + 1, line + line_len);
+		}
+		head = line_end + 1;
+	}
+	
+	// open addressing table with at most 50% load; the first occurrence of a key wins
+	size_t table_size = 8;
+	while (table_size < slots.size() * 2) table_size *= 2;
+	header_index.assign(table_size, HeaderSlot());
+	for (auto &slot : slots) {
+		size_t pos = slot.hash & (table_size - 1);
+		bool duplicate = false;
+		while (header_index[pos].key_len) {
+			if (header_index[pos].hash == slot.hash && header_index[pos].key_len == slot.key_len &&
+				header_key_equal(begin + header_index[pos].key_pos, begin + slot.key_pos, slot.key_len)) {
+				duplicate = true;
+				break;
+			}
+			pos = (pos + 1) & (table_size - 1);
+		}
+		if (!duplicate) header_index[pos] = slot;
+	}
+}
 
+NetworkHeaderView NetworkResult::get_header_view(const char *key) const {
+	NetworkHeaderView res;
+	if (!header_index.size()) return res;
+	size_t key_len = strlen(key);
+	uint32_t hash = header_key_hash(key, key_len);
+	size_t mask = header_index.size() - 1;
+	for (size_t pos = hash & mask; header_index[pos].key_len; pos = (pos + 1) & mask) {
+		const HeaderSlot &slot = header_index[pos];
+		if (slot.hash == hash && slot.key_len == key_len && header_key_equal(response_headers.c_str() + slot.key_pos, key, key_len)) {
+			res.data = response_headers.c_str() + slot.value_pos;
+			res.size = slot.value_len;
+			res.found = true;
+			break;
+		}
+	}
+	return res;
+}
 
+std::string NetworkResult::get_header(std::string key) {
+	return get_header_view(key.c_str()).str();
+}
+bool NetworkResult::body_matches_content_length() const {
+	auto content_length = get_header_view("Content-Length");
+	if (!content_length.found) return true;
+	return strtoull(content_length.str().c_str(), NULL, 10) == data.size();
+}
@@ -0,0 +1,140 @@
+#include "network/network_livestream.hpp"
+#include "network/network_downloader.hpp"
+#include "network/network_fragment.hpp"
+#include <map>
+#include <algorithm>
+
+#define DOWNLOADER_THREAD_STACK_SIZE 0x10000
+#define CLOSE_WAIT_INTERVAL 10000 // us
+
+struct Livestream {
+	NetworkStreamDownloader downloader;
+	SceUID downloader_thread = -1;
+	NetworkFragmentPrefetcher prefetcher;
+	std::vector<NetworkFragmentSource *> sources; // one per url
+	int user_num = 0; // calls in progress, guarded by livestream_lock
+};
+
+static NetworkMutex livestream_lock("livestream_lock");
+static std::map<int, Livestream *> livestreams;
+static int next_livestream_id = 0;
+
+// the livestream with its user_num incremented, NULL if there is none
+static Livestream *acquire_livestream(int id) {
+	Livestream *res = NULL;
+	livestream_lock.lock();
+	auto itr = livestreams.find(id);
+	if (itr != livestreams.end()) {
+		res = itr->second;
+		res->user_num++;
+	}
+	livestream_lock.unlock();
+	return res;
+}
+static void release_livestream(Livestream *livestream) {
+	livestream_lock.lock();
+	livestream->user_num--;
+	livestream_lock.unlock();
+}
+
+int network_livestream_open(const std::vector<std::string> &urls, double fragment_len, int first_seq) {
+	if (!urls.size() || first_seq < 0) return -1;
+
+	Livestream *livestream = new Livestream();
+	NetworkStreamDownloader *downloader = &livestream->downloader;
+	livestream->downloader_thread = sceKernelCreateThread("livestream_downloader", network_downloader_thread, SCE_KERNEL_DEFAULT_PRIORITY_USER,
+		DOWNLOADER_THREAD_STACK_SIZE, 0, 0, NULL);
+	if (livestream->downloader_thread < 0 || sceKernelStartThread(livestream->downloader_thread, sizeof(downloader), &downloader) < 0) {
+		if (livestream->downloader_thread >= 0) sceKernelDeleteThread(livestream->downloader_thread);
+		delete livestream;
+		return -1;
+	}
+	livestream->prefetcher.init(livestream->downloader, urls, fragment_len);
+	for (int i = 0; i < (int) urls.size(); i++) {
+		livestream->sources.push_back(new NetworkFragmentSource());
+		livestream->sources.back()->init(livestream->prefetcher, i, first_seq);
+	}
+
+	livestream_lock.lock();
+	int id = next_livestream_id++;
+	livestreams[id] = livestream;
+	livestream_lock.unlock();
+	return id;
+}
+
+void network_livestream_close(int id) {
+	livestream_lock.lock();
+	auto itr = livestreams.find(id);
+	if (itr == livestreams.end()) {
+		livestream_lock.unlock();
+		return;
+	}
+	Livestream *livestream = itr->second;
+	livestreams.erase(itr);
+	for (auto source : livestream->sources) source->quit_request = true;
+	// the reads in progress notice quit_request within a wait interval of the fragment source
+	while (livestream->user_num) {
+		livestream_lock.unlock();
+		sceKernelDelayThread(CLOSE_WAIT_INTERVAL);
+		livestream_lock.lock();
+	}
+	livestream_lock.unlock();
+
+	for (auto source : livestream->sources) delete source;
+	livestream->prefetcher.deinit();
+	livestream->downloader.request_thread_exit();
+	sceKernelWaitThreadEnd(livestream->downloader_thread, NULL, NULL);
+	sceKernelDeleteThread(livestream->downloader_thread);
+	livestream->downloader.delete_all();
+	delete livestream;
+}
+
+int network_livestream_read(int id, int url_index, unsigned char *buf, int buf_size) {
+	Livestream *livestream = acquire_livestream(id);
+	if (!livestream) return NETWORK_STREAM_AVERROR_EOF;
+	int res = NETWORK_STREAM_AVERROR_EIO;
+	if (url_index >= 0 && url_index < (int) livestream->sources.size()) res = livestream->sources[url_index]->read(buf, buf_size);
+	release_livestream(livestream);
+	return res;
+}
+
+bool network_livestream_seek(int id, int seq) {
+	if (seq < 0) return false;
+	Livestream *livestream = acquire_livestream(id);
+	if (!livestream) return false;
+	for (int i = 0; i < (int) livestream->sources.size(); i++) livestream->sources[i]->init(livestream->prefetcher, i, seq);
+	release_livestream(livestream);
+	return true;
+}
+
+int network_livestream_get_cur_seq(int id, int url_index) {
+	Livestream *livestream = acquire_livestream(id);
+	if (!livestream) return -1;
+	int res = url_index >= 0 && url_index < (int) livestream->sources.size() ? livestream->sources[url_index]->get_cur_seq() : -1;
+	release_livestream(livestream);
+	return res;
+}
+
+int network_livestream_get_seq_head(int id) {
+	Livestream *livestream = acquire_livestream(id);
+	if (!livestream) return -1;
+	int res = std::max(livestream->prefetcher.get_seq_head(), livestream->prefetcher.get_segment_index().get_seq_head());
+	release_livestream(livestream);
+	return res;
+}
+
+int network_livestream_find(int id, double time) {
+	Livestream *livestream = acquire_livestream(id);
+	if (!livestream) return -1;
+	int res = livestream->prefetcher.get_segment_index().find(time);
+	release_livestream(livestream);
+	return res;
+}
+
+double network_livestream_get_start_time(int id, int seq) {
+	Livestream *livestream = acquire_livestream(id);
+	if (!livestream) return -1;
+	double res = livestream->prefetcher.get_segment_index().get_start_time(seq);
+	release_livestream(livestream);
+	return res;
+}
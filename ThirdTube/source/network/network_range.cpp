@@ -0,0 +1,283 @@
+#include "network/network_range.hpp"
+#include "network/network_stats.hpp"
+#include <vector>
+#include <algorithm>
+
+#define HEDGE_THREAD_STACK_SIZE 0x10000
+#define WATCHDOG_THREAD_STACK_SIZE 0x4000
+#define WATCHDOG_QUEUED_INTERVAL 100000 // us, how often attempts still waiting for the scheduler are looked at
+
+// used until the endpoint has a measured throughput
+#define DEFAULT_STALL_TIMEOUT 3000000
+#define DEFAULT_TOTAL_TIMEOUT 8000000
+#define STALL_TIMEOUT_MIN 500000
+#define STALL_TIMEOUT_MAX 4000000
+
+#define BACKOFF_BASE 200000
+#define BACKOFF_MAX 3000000
+
+/*
+	The attempts of a fetch run on the calling thread, one after another when they fail.
+	Hedged copies are started by a single watchdog thread shared by every fetch, each on a thread of its own.
+	Whichever attempt finishes first decides the result, the others are aborted.
+*/
+struct RangeAttempt {
+	NetworkRequestControl control;
+	NetworkResult result;
+};
+struct RangeFetch {
+	std::string url;
+	std::map<std::string, std::string> request_headers;
+	std::string endpoint;
+	SceUInt64 size = 0;
+	NetworkTrafficClass traffic_class = NetworkTrafficClass::AUTO;
+	NetworkRequestControl *control = NULL; // of the caller, may be NULL
+	SceUID wake_sema = -1; // signaled when an attempt finishes or the fetch is aborted
+	std::vector<RangeAttempt *> running;
+	int attempt_num = 0;
+	int failure_num = 0;
+	bool finished = false;
+	bool aborted = false;
+	NetworkResult res;
+};
+struct HedgeThreadArgs {
+	RangeFetch *fetch;
+	RangeAttempt *attempt;
+};
+// guards every RangeFetch and the list below
+static NetworkMutex range_lock("range_lock");
+static std::vector<RangeFetch *> fetches;
+static SceUID watchdog_thread = -1;
+static SceUID watchdog_sema = -1;
+
+// exponentially weighted averages of earlier successful range fetches, per endpoint (see network_stats_get_endpoint())
+struct ThroughputEstimate {
+	SceUInt64 bytes_per_sec = 0;
+	SceUInt64 first_byte_time = 0; // us
+};
+static NetworkMutex estimate_lock("range_estimate_lock");
+static std::map<std::string, ThroughputEstimate> estimates;
+
+static SceUInt32 random_state = 0;
+static SceUInt32 get_random() { // xorshift, only used for jitter
+	if (!random_state) random_state = (SceUInt32) sceKernelGetProcessTimeWide() | 1;
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+static void update_estimate(const std::string &endpoint, const NetworkResult &result) {
+	SceUInt64 first_byte_time = result.timing.setup + result.timing.send + result.timing.response;
+	SceUInt64 bytes_per_sec = result.data.size() * 1000000 / std::max<SceUInt64>(result.timing.transfer, 1);
+	estimate_lock.lock();
+	ThroughputEstimate &estimate = estimates[endpoint];
+	if (!estimate.bytes_per_sec) {
+		estimate.bytes_per_sec = bytes_per_sec;
+		estimate.first_byte_time = first_byte_time;
+	} else {
+		estimate.bytes_per_sec = (estimate.bytes_per_sec * 3 + bytes_per_sec) / 4;
+		estimate.first_byte_time = (estimate.first_byte_time * 3 + first_byte_time) / 4;
+	}
+	estimate_lock.unlock();
+}
+// stall_timeout : longest acceptable time without receiving anything, total_timeout : longest acceptable time for the whole attempt
+static void get_deadlines(const std::string &endpoint, SceUInt64 size, SceUInt64 &stall_timeout, SceUInt64 &total_timeout) {
+	estimate_lock.lock();
+	ThroughputEstimate estimate = estimates.count(endpoint) ? estimates[endpoint] : ThroughputEstimate();
+	estimate_lock.unlock();
+	if (!estimate.bytes_per_sec) {
+		stall_timeout = DEFAULT_STALL_TIMEOUT;
+		total_timeout = DEFAULT_TOTAL_TIMEOUT;
+		return;
+	}
+	stall_timeout = std::min<SceUInt64>(std::max<SceUInt64>(estimate.first_byte_time * 3, STALL_TIMEOUT_MIN), STALL_TIMEOUT_MAX);
+	total_timeout = 2 * (estimate.first_byte_time + size * 1000000 / estimate.bytes_per_sec) + STALL_TIMEOUT_MIN;
+}
+
+// the clocks start when the scheduler admits the attempt : a copy of a queued request would only queue behind it
+static bool attempt_is_stalled(const RangeAttempt *attempt, SceUInt64 now, SceUInt64 stall_timeout, SceUInt64 total_timeout) {
+	SceUInt64 admit_time = attempt->control.admit_time;
+	if (!admit_time) return false;
+	SceUInt64 last_progress = std::max<SceUInt64>((SceUInt64) attempt->control.last_progress_time, admit_time);
+	return now - last_progress > stall_timeout || now - admit_time > total_timeout;
+}
+
+// must be called with range_lock held
+static void abort_fetch(RangeFetch *fetch) {
+	fetch->aborted = true;
+	for (auto attempt : fetch->running) attempt->control.abort();
+	sceKernelSignalSema(fetch->wake_sema, 1);
+}
+void network_range_abort(NetworkRequestControl *control) {
+	range_lock.lock();
+	if (control->range_fetch) abort_fetch(control->range_fetch);
+	range_lock.unlock();
+}
+
+// `attempt` must already be in fetch->running
+static void run_attempt(RangeFetch *fetch, RangeAttempt *attempt) {
+	attempt->result = Access_http_get(fetch->url, fetch->request_headers, true, &attempt->control);
+	attempt->result.finalize();
+	
+	bool success = !attempt->result.fail && attempt->result.status_code_is_success();
+	// 4xx (e.g. an expired url) will not get better by retrying
+	bool retryable = attempt->result.fail || attempt->result.status_code / 100 == 5;
+	if (success) update_estimate(fetch->endpoint, attempt->result);
+	
+	range_lock.lock();
+	fetch->running.erase(std::find(fetch->running.begin(), fetch->running.end(), attempt));
+	if (!fetch->finished && (success || !retryable || (fetch->attempt_num >= NETWORK_RANGE_MAX_ATTEMPTS && !fetch->running.size()))) {
+		std::swap(fetch->res, attempt->result);
+		fetch->finished = true;
+		// cancel the slower copies
+		for (auto other : fetch->running) other->control.abort();
+	}
+	if (!success) fetch->failure_num++;
+	delete attempt;
+	sceKernelSignalSema(fetch->wake_sema, 1);
+	range_lock.unlock();
+}
+// must be called with range_lock held
+static RangeAttempt *add_attempt(RangeFetch *fetch) {
+	RangeAttempt *attempt = new RangeAttempt();
+	attempt->control.coalesce = false;
+	attempt->control.traffic_class = fetch->traffic_class;
+	fetch->running.push_back(attempt);
+	fetch->attempt_num++;
+	return attempt;
+}
+
+static SceInt32 hedge_thread(SceSize args, void *argp) {
+	HedgeThreadArgs *hedge = (HedgeThreadArgs *) argp;
+	run_attempt(hedge->fetch, hedge->attempt);
+	return sceKernelExitDeleteThread(0);
+}
+// must be called with range_lock held
+static void start_hedge(RangeFetch *fetch) {
+	HedgeThreadArgs hedge;
+	hedge.fetch = fetch;
+	hedge.attempt = add_attempt(fetch);
+	SceUID thread = sceKernelCreateThread("range_hedge", hedge_thread, SCE_KERNEL_DEFAULT_PRIORITY_USER, HEDGE_THREAD_STACK_SIZE, 0, 0, NULL);
+	if (thread < 0 || sceKernelStartThread(thread, sizeof(hedge), &hedge) < 0) {
+		if (thread >= 0) sceKernelDeleteThread(thread);
+		fetch->running.pop_back();
+		fetch->attempt_num--;
+		delete hedge.attempt;
+	}
+}
+
+// hedge : the most recent attempt of a fetch missed its deadline, start a duplicate while keeping it running
+static SceInt32 watchdog_thread_func(SceSize args, void *argp) {
+	while (1) {
+		SceUInt64 next_check = 0; // us from now, 0 while there is nothing to watch
+		range_lock.lock();
+		for (auto fetch : fetches) {
+			if (fetch->finished || fetch->aborted || !fetch->running.size()) continue;
+			if (fetch->running.size() >= NETWORK_RANGE_MAX_PARALLEL || fetch->attempt_num >= NETWORK_RANGE_MAX_ATTEMPTS) continue;
+			
+			SceUInt64 now = sceKernelGetProcessTimeWide();
+			SceUInt64 stall_timeout, total_timeout;
+			get_deadlines(fetch->endpoint, fetch->size, stall_timeout, total_timeout);
+			RangeAttempt *attempt = fetch->running.back();
+			SceUInt64 cur_check;
+			if (attempt_is_stalled(attempt, now, stall_timeout, total_timeout)) {
+				start_hedge(fetch);
+				cur_check = WATCHDOG_QUEUED_INTERVAL; // the new attempt is most likely still queued
+			} else if (!attempt->control.admit_time) cur_check = WATCHDOG_QUEUED_INTERVAL;
+			else {
+				SceUInt64 admit_time = attempt->control.admit_time;
+				SceUInt64 last_progress = std::max<SceUInt64>((SceUInt64) attempt->control.last_progress_time, admit_time);
+				SceUInt64 deadline = std::min(last_progress + stall_timeout, admit_time + total_timeout);
+				cur_check = deadline > now ? deadline - now + 1 : 1;
+			}
+			if (!next_check || cur_check < next_check) next_check = cur_check;
+		}
+		range_lock.unlock();
+		
+		if (next_check) {
+			SceUInt32 timeout = (SceUInt32) std::min<SceUInt64>(next_check, 0xFFFFFFFF);
+			sceKernelWaitSema(watchdog_sema, 1, &timeout);
+		} else sceKernelWaitSema(watchdog_sema, 1, NULL);
+	}
+	return 0;
+}
+
+NetworkResult Access_http_get_range(const std::string &url, SceUInt64 start, SceUInt64 end,
+	const std::map<std::string, std::string> &request_headers, NetworkRequestControl *control) {
+
+	RangeFetch *fetch = new RangeFetch();
+	fetch->url = url;
+	fetch->request_headers = request_headers;
+	fetch->request_headers["Range"] = "bytes=" + std::to_string(start) + "-" + std::to_string(end);
+	fetch->endpoint = network_stats_get_endpoint(url);
+	fetch->size = end - start + 1;
+	fetch->traffic_class = control ? control->traffic_class : NetworkTrafficClass::AUTO;
+	fetch->control = control;
+	fetch->wake_sema = sceKernelCreateSema("range_fetch", 0, 0, 0x7FFFFFFF, NULL);
+	
+	range_lock.lock();
+	if (watchdog_thread < 0) {
+		watchdog_sema = sceKernelCreateSema("range_watchdog", 0, 0, 0x7FFFFFFF, NULL);
+		watchdog_thread = sceKernelCreateThread("range_watchdog", watchdog_thread_func, SCE_KERNEL_DEFAULT_PRIORITY_USER, WATCHDOG_THREAD_STACK_SIZE, 0, 0, NULL);
+		if (watchdog_thread >= 0) sceKernelStartThread(watchdog_thread, 0, NULL);
+	}
+	fetches.push_back(fetch);
+	// abort() sets abort_request before it looks at range_fetch, so one of the two always sees the other
+	if (control) {
+		control->range_fetch = fetch;
+		if (control->abort_request) fetch->aborted = true;
+	}
+	
+	SceUInt64 retry_time = 0;
+	while (!fetch->finished && !fetch->aborted) {
+		if (fetch->running.size()) { // a hedged copy is still running, wait for it
+			range_lock.unlock();
+			sceKernelWaitSema(fetch->wake_sema, 1, NULL);
+			range_lock.lock();
+			continue;
+		}
+		if (fetch->attempt_num) {
+			// every attempt so far failed : back off before the next one
+			SceUInt64 now = sceKernelGetProcessTimeWide();
+			if (!retry_time) {
+				SceUInt64 backoff = std::min<SceUInt64>((SceUInt64) BACKOFF_BASE << std::min(fetch->failure_num - 1, 8), BACKOFF_MAX);
+				retry_time = now + backoff / 2 + get_random() % (backoff / 2 + 1);
+			}
+			if (now < retry_time) {
+				SceUInt32 timeout = retry_time - now;
+				range_lock.unlock();
+				sceKernelWaitSema(fetch->wake_sema, 1, &timeout); // woken early only by an abort
+				range_lock.lock();
+				continue;
+			}
+			retry_time = 0;
+		}
+		RangeAttempt *attempt = add_attempt(fetch);
+		range_lock.unlock();
+		sceKernelSignalSema(watchdog_sema, 1);
+		run_attempt(fetch, attempt);
+		range_lock.lock();
+	}
+	
+	NetworkResult res;
+	if (fetch->finished) std::swap(res, fetch->res);
+	else {
+		res.fail = true;
+		res.error = "aborted";
+	}
+	// the hedged copies still running refer to `fetch`
+	for (auto attempt : fetch->running) attempt->control.abort();
+	while (fetch->running.size()) {
+		range_lock.unlock();
+		sceKernelWaitSema(fetch->wake_sema, 1, NULL);
+		range_lock.lock();
+	}
+	fetches.erase(std::find(fetches.begin(), fetches.end(), fetch));
+	if (control) control->range_fetch = NULL;
+	range_lock.unlock();
+	
+	sceKernelDeleteSema(fetch->wake_sema);
+	delete fetch;
+	return res;
+}
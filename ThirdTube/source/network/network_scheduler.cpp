@@ -0,0 +1,116 @@
+#include "network/network_scheduler.hpp"
+#include <algorithm>
+
+#define POLL_INTERVAL 10000 // us
+#define WINDOW_LENGTH 250000 // us, throughput is measured over windows of this length
+#define PREEMPT_INTERVAL 50000 // us
+#define MIN_WINDOW_BYTES 0x4000 // so that a cold estimate does not stall everyone
+// the paced classes together may exceed the estimate by this much (in percent), so that the estimate can still grow
+#define PROBE_HEADROOM 25
+
+// index : NetworkTrafficClass
+static const int concurrency_limits[NETWORK_TRAFFIC_CLASS_NUM] = {4, 3, 2, 3, 1};
+static const int bandwidth_weights[NETWORK_TRAFFIC_CLASS_NUM] = {60, 25, 8, 5, 2};
+
+struct ClassState {
+	int active = 0;
+	int waiting = 0;
+	SceUInt64 window_bytes = 0;
+};
+
+static NetworkMutex scheduler_lock("scheduler_lock");
+static ClassState states[NETWORK_TRAFFIC_CLASS_NUM];
+static int active_total = 0;
+static SceUInt64 window_start = 0;
+static SceUInt64 window_total = 0;
+// link capacity in bytes per window : the peak of recent windows, slowly decaying
+static SceUInt64 window_estimate = 0;
+static volatile bool playback_critical = false;
+
+NetworkTrafficClass network_scheduler_classify(const std::string &url) {
+	auto host = url_get_host_name(url);
+	auto ends_with = [&] (const std::string &suffix) {
+		return host.size() >= suffix.size() && host.substr(host.size() - suffix.size()) == suffix;
+	};
+	if (ends_with(".googlevideo.com")) return NetworkTrafficClass::PLAYBACK;
+	if (ends_with("ytimg.com") || ends_with("ggpht.com")) return NetworkTrafficClass::THUMBNAIL;
+	return NetworkTrafficClass::INTERACTIVE;
+}
+
+// must be called with scheduler_lock held
+static bool can_start(int class_index) {
+	if (states[class_index].active >= concurrency_limits[class_index]) return false;
+	int slot_limit = NETWORK_SCHEDULER_MAX_CONNECTIONS;
+	if (class_index >= (int) NetworkTrafficClass::PREFETCH) slot_limit -= NETWORK_SCHEDULER_RESERVED_SLOTS;
+	if (active_total >= slot_limit) return false;
+	for (int i = 0; i < class_index; i++) if (states[i].waiting) return false;
+	return true;
+}
+static void roll_window(SceUInt64 now) {
+	if (now - window_start < WINDOW_LENGTH) return;
+	// the paced classes may send more than the estimate (PROBE_HEADROOM), so pacing alone never drags it down
+	// an idle gap says nothing about the link at all
+	if (window_total) window_estimate = std::max(window_total, window_estimate * 7 / 8);
+	window_start = now;
+	window_total = 0;
+	for (auto &state : states) state.window_bytes = 0;
+}
+
+bool network_scheduler_acquire(NetworkTrafficClass traffic_class, const volatile bool *abort_request) {
+	int class_index = (int) traffic_class;
+	bool waiting = false;
+	while (1) {
+		scheduler_lock.lock();
+		if (can_start(class_index) || (abort_request && *abort_request)) {
+			bool aborted = abort_request && *abort_request;
+			if (waiting) states[class_index].waiting--;
+			if (!aborted) {
+				states[class_index].active++;
+				active_total++;
+			}
+			scheduler_lock.unlock();
+			return !aborted;
+		}
+		if (!waiting) states[class_index].waiting++;
+		waiting = true;
+		scheduler_lock.unlock();
+		sceKernelDelayThread(POLL_INTERVAL);
+	}
+}
+
+void network_scheduler_release(NetworkTrafficClass traffic_class) {
+	scheduler_lock.lock();
+	states[(int) traffic_class].active--;
+	active_total--;
+	scheduler_lock.unlock();
+}
+
+void network_scheduler_throttle(NetworkTrafficClass traffic_class, SceSize bytes, const volatile bool *abort_request) {
+	int class_index = (int) traffic_class;
+
+	scheduler_lock.lock();
+	SceUInt64 now = sceKernelGetProcessTimeWide();
+	roll_window(now);
+	states[class_index].window_bytes += bytes;
+	window_total += bytes;
+
+	// playback is never delayed, its weight only reserves its share from the other classes
+	SceUInt64 delay = 0;
+	bool preemptable = traffic_class != NetworkTrafficClass::PLAYBACK;
+	int weight_sum = 0;
+	for (int i = 0; i < NETWORK_TRAFFIC_CLASS_NUM; i++) if (states[i].active) weight_sum += bandwidth_weights[i];
+	if (preemptable && weight_sum > bandwidth_weights[class_index]) {
+		SceUInt64 capacity = std::max<SceUInt64>(window_estimate, MIN_WINDOW_BYTES) * (100 + PROBE_HEADROOM) / 100;
+		SceUInt64 allowed = capacity * bandwidth_weights[class_index] / weight_sum;
+		if (states[class_index].window_bytes > allowed) delay = window_start + WINDOW_LENGTH - now;
+	}
+	scheduler_lock.unlock();
+
+	if (delay) sceKernelDelayThread(delay);
+	// not reading lets the receive window fill up, which hands the link over to playback
+	while (preemptable && playback_critical && !(abort_request && *abort_request)) sceKernelDelayThread(PREEMPT_INTERVAL);
+}
+
+void network_scheduler_set_playback_critical(bool critical) {
+	playback_critical = critical;
+}
@@ -0,0 +1,286 @@
+#include "network/network_spill.hpp"
+#include <list>
+#include <deque>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <iterator>
+
+/*
+	block file layout (all integers little-endian)
+	"TTSB" u32 version, u32 data_size, u32 checksum (FNV-1a of the data), data
+*/
+
+#define SPILL_MAGIC "TTSB"
+#define SPILL_VERSION 1
+#define SPILL_HEADER_SIZE 16
+#define MAX_PENDING_BLOCKS 8 // blocks waiting to be written are in memory, so the queue is short
+#define WRITER_THREAD_STACK_SIZE 0x4000
+
+struct PendingBlock {
+	std::string group;
+	std::string path;
+	NetworkStreamBlock *block;
+};
+struct SpillFile {
+	SceSize size;
+	std::list<std::string>::iterator lru_itr;
+};
+
+static NetworkMutex spill_lock("spill_lock");
+static std::string spill_path = NETWORK_SPILL_DEFAULT_PATH;
+static volatile SceSize spill_quota = 0;
+static SceUInt32 hit_count = 0;
+static SceUInt32 miss_count = 0;
+
+static std::deque<PendingBlock> pending_blocks;
+static SceUID pending_sema = -1;
+static SceUID writer_thread = -1;
+
+static bool index_loaded = false;
+static std::list<std::string> file_lru; // most recently used first
+static std::map<std::string, SpillFile> file_index; // path -> file
+static SceSize spill_usage = 0;
+
+
+static SceUInt32 get_checksum(const uint8_t *data, size_t size) {
+	SceUInt32 hash = 0x811C9DC5;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+static void write_u32(uint8_t *out, SceUInt32 value) {
+	for (int i = 0; i < 4; i++) out[i] = value >> (i * 8) & 0xFF;
+}
+static SceUInt32 read_u32(const uint8_t *in) {
+	SceUInt32 res = 0;
+	for (int i = 0; i < 4; i++) res |= (SceUInt32) in[i] << (i * 8);
+	return res;
+}
+
+static std::string get_block_path(const std::string &group, const std::string &stream_key, uint64_t block_index) {
+	return spill_path + group + "/" + stream_key + "_" + std::to_string(block_index) + ".blk";
+}
+
+
+// the functions below must be called with spill_lock held
+
+static void load_index() {
+	if (index_loaded) return;
+	index_loaded = true;
+
+	// create every component of the path, the result does not matter if it already exists
+	for (size_t pos = spill_path.find('/'); pos != std::string::npos; pos = spill_path.find('/', pos + 1))
+		sceIoMkdir(spill_path.substr(0, pos).c_str(), 0777);
+
+	SceUID group_dfd = sceIoDopen(spill_path.c_str());
+	if (group_dfd < 0) return;
+	SceIoDirent group_dirent;
+	while (sceIoDread(group_dfd, &group_dirent) > 0) {
+		if (!SCE_S_ISDIR(group_dirent.d_stat.st_mode) || group_dirent.d_name[0] == '.') continue;
+		std::string group_path = spill_path + group_dirent.d_name + "/";
+		SceUID dfd = sceIoDopen(group_path.c_str());
+		if (dfd < 0) continue;
+		SceIoDirent dirent;
+		while (sceIoDread(dfd, &dirent) > 0) {
+			if (SCE_S_ISDIR(dirent.d_stat.st_mode)) continue;
+			std::string path = group_path + dirent.d_name;
+			file_lru.push_back(path);
+			file_index[path] = {(SceSize) dirent.d_stat.st_size, std::prev(file_lru.end())};
+			spill_usage += dirent.d_stat.st_size;
+		}
+		sceIoDclose(dfd);
+	}
+	sceIoDclose(group_dfd);
+}
+// drops the file from the index only, returns false if it was not indexed
+static bool forget_file(const std::string &path) {
+	auto itr = file_index.find(path);
+	if (itr == file_index.end()) return false;
+	spill_usage -= itr->second.size;
+	file_lru.erase(itr->second.lru_itr);
+	file_index.erase(itr);
+	return true;
+}
+static void remove_file(const std::string &path) {
+	if (forget_file(path)) sceIoRemove(path.c_str());
+}
+static void shrink(SceSize quota) {
+	while (spill_usage > quota) remove_file(file_lru.back());
+}
+
+
+static bool write_block(const std::string &group, const std::string &path, const NetworkStreamBlock *block) {
+	sceIoMkdir((spill_path + group).c_str(), 0777);
+	uint8_t header[SPILL_HEADER_SIZE];
+	memcpy(header, SPILL_MAGIC, 4);
+	write_u32(header + 4, SPILL_VERSION);
+	write_u32(header + 8, block->data.size());
+	write_u32(header + 12, get_checksum(block->data.data(), block->data.size()));
+
+	SceUID fd = sceIoOpen(path.c_str(), SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0666);
+	if (fd < 0) return false;
+	bool ok = sceIoWrite(fd, header, SPILL_HEADER_SIZE) == SPILL_HEADER_SIZE &&
+		sceIoWrite(fd, block->data.data(), block->data.size()) == (int) block->data.size();
+	sceIoClose(fd);
+	if (!ok) sceIoRemove(path.c_str());
+	return ok;
+}
+
+static SceInt32 writer_thread_func(SceSize args, void *argp) {
+	while (1) {
+		sceKernelWaitSema(pending_sema, 1, NULL);
+		spill_lock.lock();
+		PendingBlock pending = pending_blocks.front();
+		spill_lock.unlock();
+
+		// the block stays in the queue while it is written so that network_spill_load() can still find it
+		SceSize file_size = SPILL_HEADER_SIZE + pending.block->data.size();
+		bool ok = spill_quota >= file_size && write_block(pending.group, pending.path, pending.block);
+
+		spill_lock.lock();
+		if (ok) {
+			load_index();
+			forget_file(pending.path); // the entry of an earlier spill of the same block, its file was just overwritten
+			shrink(spill_quota > file_size ? spill_quota - file_size : 0);
+			file_lru.push_front(pending.path);
+			file_index[pending.path] = {file_size, file_lru.begin()};
+			spill_usage += file_size;
+		}
+		pending_blocks.pop_front();
+		spill_lock.unlock();
+		delete pending.block;
+	}
+	return 0;
+}
+
+
+void network_spill_set_path(const std::string &path) {
+	spill_lock.lock();
+	spill_path = path;
+	index_loaded = false;
+	file_lru.clear();
+	file_index.clear();
+	spill_usage = 0;
+	spill_lock.unlock();
+}
+
+void network_spill_set_quota(unsigned int quota) {
+	spill_lock.lock();
+	spill_quota = quota;
+	if (index_loaded) shrink(quota);
+	spill_lock.unlock();
+}
+
+void network_spill_remove_group(const std::string &group) {
+	spill_lock.lock();
+	load_index();
+	std::string prefix = spill_path + group + "/";
+	std::vector<std::string> paths;
+	for (auto &file : file_index) if (!file.first.compare(0, prefix.size(), prefix)) paths.push_back(file.first);
+	for (auto &path : paths) remove_file(path);
+	sceIoRmdir((spill_path + group).c_str());
+	spill_lock.unlock();
+}
+
+void network_spill_clear() {
+	spill_lock.lock();
+	load_index();
+	shrink(0);
+	spill_lock.unlock();
+}
+
+void network_spill_get_stats(unsigned int *hit_count_out, unsigned int *miss_count_out) {
+	spill_lock.lock();
+	*hit_count_out = hit_count;
+	*miss_count_out = miss_count;
+	spill_lock.unlock();
+}
+
+bool network_spill_is_enabled() { return spill_quota > 0; }
+
+std::string network_spill_get_default_group(const std::string &url) {
+	auto id = url_get_param(url, "id");
+	// the parameter is an opaque token, keep only characters that are safe in a file name
+	std::string res;
+	for (auto c : id) if (isalnum(c) || c == '-' || c == '_') res.push_back(c);
+	return res.size() ? res : "unknown";
+}
+std::string network_spill_get_stream_key(const std::string &url) {
+	auto itag = url_get_param(url, "itag");
+	auto clen = url_get_param(url, "clen");
+	bool valid = itag.size() && clen.size();
+	for (auto c : itag + clen) if (!isdigit(c)) valid = false;
+	if (valid) return itag + "_" + clen;
+
+	SceUInt32 hash = get_checksum((const uint8_t *) url.data(), url.size());
+	char buf[16];
+	snprintf(buf, sizeof(buf), "u%08x", (unsigned int) hash);
+	return buf;
+}
+
+void network_spill_store(const std::string &group, const std::string &stream_key, uint64_t block_index, NetworkStreamBlock *block) {
+	spill_lock.lock();
+	if (!spill_quota || pending_blocks.size() >= MAX_PENDING_BLOCKS) {
+		spill_lock.unlock();
+		delete block;
+		return;
+	}
+	if (writer_thread < 0) {
+		pending_sema = sceKernelCreateSema("spill_pending", 0, 0, 0x7FFFFFFF, NULL);
+		writer_thread = sceKernelCreateThread("spill_writer", writer_thread_func, SCE_KERNEL_DEFAULT_PRIORITY_USER + 10, WRITER_THREAD_STACK_SIZE, 0, 0, NULL);
+		if (writer_thread >= 0) sceKernelStartThread(writer_thread, 0, NULL);
+	}
+	pending_blocks.push_back({group, get_block_path(group, stream_key, block_index), block});
+	spill_lock.unlock();
+	sceKernelSignalSema(pending_sema, 1);
+}
+
+bool network_spill_load(const std::string &group, const std::string &stream_key, uint64_t block_index, std::vector<uint8_t> &out) {
+	if (!spill_quota) return false;
+	std::string path = get_block_path(group, stream_key, block_index);
+
+	spill_lock.lock();
+	for (auto &pending : pending_blocks) {
+		if (pending.path == path) {
+			out = pending.block->data;
+			hit_count++;
+			spill_lock.unlock();
+			return true;
+		}
+	}
+	load_index();
+	auto itr = file_index.find(path);
+	bool found = itr != file_index.end();
+	if (found) file_lru.splice(file_lru.begin(), file_lru, itr->second.lru_itr);
+	else miss_count++;
+	spill_lock.unlock();
+	if (!found) return false;
+
+	bool ok = false;
+	SceUID fd = sceIoOpen(path.c_str(), SCE_O_RDONLY, 0);
+	if (fd >= 0) {
+		uint8_t header[SPILL_HEADER_SIZE];
+		if (sceIoRead(fd, header, SPILL_HEADER_SIZE) == SPILL_HEADER_SIZE && !memcmp(header, SPILL_MAGIC, 4) &&
+			read_u32(header + 4) == SPILL_VERSION) {
+
+			SceUInt32 size = read_u32(header + 8);
+			out.resize(size);
+			ok = sceIoRead(fd, out.data(), size) == (int) size && get_checksum(out.data(), size) == read_u32(header + 12);
+		}
+		sceIoClose(fd);
+	}
+
+	spill_lock.lock();
+	if (ok) hit_count++;
+	else { // truncated or corrupted : never trust it again
+		miss_count++;
+		remove_file(path);
+	}
+	spill_lock.unlock();
+	if (!ok) out.clear();
+	return ok;
+}
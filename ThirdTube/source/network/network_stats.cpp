@@ -0,0 +1,114 @@
+#include "network/network_stats.hpp"
+#include "network/network_io.hpp"
+#include <map>
+#include <algorithm>
+#include <sstream>
+
+// bucket 0 : < 1 ms, bucket i : [2^(i-1), 2^i) ms, the last bucket also holds everything above
+#define HISTOGRAM_BUCKETS 18
+
+enum {
+	PHASE_SETUP,
+	PHASE_SEND,
+	PHASE_RESPONSE,
+	PHASE_TRANSFER,
+	PHASE_TOTAL,
+	PHASE_NUM
+};
+static const char *phase_names[PHASE_NUM] = {"setup", "send", "response", "transfer", "total"};
+
+struct EndpointStats {
+	SceUInt64 count = 0;
+	SceUInt64 fail_count = 0;
+	SceUInt64 redirect_count = 0;
+	SceUInt64 bytes_sent = 0;
+	SceUInt64 bytes_received = 0;
+	SceUInt64 time_sum[PHASE_NUM] = {0};
+	SceUInt64 time_max[PHASE_NUM] = {0};
+	SceUInt32 histogram[PHASE_NUM][HISTOGRAM_BUCKETS] = {{0}};
+};
+
+static NetworkMutex stats_lock("stats_lock");
+static std::map<std::string, EndpointStats> stats;
+
+static int get_bucket(SceUInt64 microseconds) {
+	SceUInt64 ms = microseconds / 1000;
+	int res = 0;
+	while (ms && res + 1 < HISTOGRAM_BUCKETS) {
+		ms >>= 1;
+		res++;
+	}
+	return res;
+}
+
+std::string network_stats_get_endpoint(const std::string &url) {
+	auto host = url_get_host_name(url);
+	if (host.size() >= 16 && host.substr(host.size() - 16) == ".googlevideo.com") host = "googlevideo.com";
+
+	auto path_start = url.find("://");
+	path_start = path_start == std::string::npos ? url.size() : url.find('/', path_start + 3);
+	std::string first_component;
+	if (path_start != std::string::npos) {
+		for (size_t i = path_start + 1; i < url.size() && url[i] != '/' && url[i] != '?' && url[i] != '#'; i++)
+			first_component.push_back(url[i]);
+	}
+	return host + "/" + first_component;
+}
+
+void network_stats_record(const std::string &url, const NetworkTiming &timing, bool fail) {
+	SceUInt64 phase_time[PHASE_NUM] = {timing.setup, timing.send, timing.response, timing.transfer, timing.total};
+	auto endpoint = network_stats_get_endpoint(url);
+
+	stats_lock.lock();
+	EndpointStats &cur_stats = stats[endpoint];
+	cur_stats.count++;
+	if (fail) cur_stats.fail_count++;
+	cur_stats.redirect_count += timing.redirect_count;
+	cur_stats.bytes_sent += timing.bytes_sent;
+	cur_stats.bytes_received += timing.bytes_received;
+	for (int i = 0; i < PHASE_NUM; i++) {
+		cur_stats.time_sum[i] += phase_time[i];
+		cur_stats.time_max[i] = std::max(cur_stats.time_max[i], phase_time[i]);
+		cur_stats.histogram[i][get_bucket(phase_time[i])]++;
+	}
+	stats_lock.unlock();
+}
+
+void network_stats_reset() {
+	stats_lock.lock();
+	stats.clear();
+	stats_lock.unlock();
+}
+
+std::string network_stats_to_string() {
+	stats_lock.lock();
+	std::map<std::string, EndpointStats> stats_copy = stats;
+	stats_lock.unlock();
+
+	std::ostringstream stream;
+	stream << "# histogram buckets (ms) : <1";
+	for (int i = 1; i < HISTOGRAM_BUCKETS; i++) stream << " <" << (1 << i);
+	stream << "+" << std::endl;
+	for (auto &endpoint : stats_copy) {
+		const EndpointStats &cur_stats = endpoint.second;
+		stream << "endpoint " << endpoint.first << std::endl;
+		stream << "  requests " << cur_stats.count << " failed " << cur_stats.fail_count << " redirects " << cur_stats.redirect_count << std::endl;
+		stream << "  bytes sent " << cur_stats.bytes_sent << " received " << cur_stats.bytes_received << std::endl;
+		for (int i = 0; i < PHASE_NUM; i++) {
+			stream << "  " << phase_names[i] << " avg_ms " << (cur_stats.count ? cur_stats.time_sum[i] / cur_stats.count / 1000 : 0)
+				<< " max_ms " << cur_stats.time_max[i] / 1000 << " hist";
+			for (int j = 0; j < HISTOGRAM_BUCKETS; j++) stream << " " << cur_stats.histogram[i][j];
+			stream << std::endl;
+		}
+	}
+	return stream.str();
+}
+
+bool network_stats_dump(const std::string &path) {
+	auto content = network_stats_to_string();
+	SceUID fd = sceIoOpen(path.c_str(), SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0666);
+	if (fd < 0) return false;
+	bool ok = sceIoWrite(fd, content.c_str(), content.size()) == (int) content.size();
+	sceIoClose(fd);
+	return ok;
+}
@@ -10,6 +10,7 @@
 #include "ui/ui.hpp"
 #include "network/network_io.hpp"
 #include "network/network_decoder_multiple.hpp"
+#include "network/network_abr.hpp"
 #include "network/thumbnail_loader.hpp"
 #include "system/util/async_task.hpp"
 #include "system/util/misc_tasks.hpp"
@@ -29,6 +30,7 @@
 
 #define MAX_THUMBNAIL_LOAD_REQUEST 30
 #define MAX_RETRY_CNT 5
+#define ABR_UPDATE_INTERVAL 1000 // ms
 
 #define TAB_GENERAL 0
 #define TAB_COMMENTS 1
@@ -53,6 +55,9 @@ namespace VideoPlayer {
 	volatile bool audio_only_mode = false;
 	volatile bool video_skip_drawing = false; // for performance reason, enabled when opening keyboard
 	volatile int video_p_value = 360;
+	volatile bool abr_enabled = false; // video_p_value is chosen by abr_controller
+	NetworkAbrController abr_controller;
+	u64 abr_last_update = 0;
 	volatile double seek_at_init_request = -1;
 	double vid_time[2][320];
 	double vid_copy_time[2] = { 0, 0, };
@@ -483,7 +488,18 @@ static void load_video_page(void *arg) {
 		if (!std::count(available_qualities.begin(), available_qualities.end(), 360))
 			available_qualities.insert(std::lower_bound(available_qualities.begin(), available_qualities.end(), 360), 360);
 		
-		video_quality_selector_view->button_texts = { (std::function<std::string ()>) []() { return LOCALIZED(OFF); } };
+		{
+			// 360p is played from the muxed stream if there is no separate one
+			std::map<int, std::string> quality_urls = cur_video_info.video_stream_urls;
+			if (!quality_urls.count(360) && cur_video_info.both_stream_url != "") quality_urls[360] = cur_video_info.both_stream_url;
+			abr_controller.set_qualities(std::vector<std::pair<int, std::string> >(quality_urls.begin(), quality_urls.end()));
+		}
+		
+		// 0 : audio only, 1 : auto, 2... : fixed quality
+		video_quality_selector_view->button_texts = {
+			(std::function<std::string ()>) []() { return LOCALIZED(OFF); },
+			(std::function<std::string ()>) []() { return LOCALIZED(AUTO); }
+		};
 		for (auto i : available_qualities) video_quality_selector_view->button_texts.push_back(std::to_string(i) + "p");
 		video_quality_selector_view->button_num = video_quality_selector_view->button_texts.size();
 		
@@ -491,16 +507,24 @@ static void load_video_page(void *arg) {
 			video_p_value = 360;
 			if (!cur_video_info.video_stream_urls.count((int) video_p_value)) audio_only_mode = true;
 		}
-		video_quality_selector_view->selected_button = audio_only_mode ? 0 : 1 + std::find(available_qualities.begin(), available_qualities.end(), (int) video_p_value) - available_qualities.begin();
+		if (audio_only_mode) video_quality_selector_view->selected_button = 0;
+		else if (abr_enabled) video_quality_selector_view->selected_button = 1;
+		else video_quality_selector_view->selected_button = 2 + std::find(available_qualities.begin(), available_qualities.end(), (int) video_p_value) - available_qualities.begin();
 		video_quality_selector_view->set_on_change([available_qualities] (const SelectorView &view) {
 			bool changed = false;
 			if (view.selected_button == 0) {
 				if (!audio_only_mode) changed = true;
 				audio_only_mode = true;
+			} else if (view.selected_button == 1) {
+				// keep the current quality, the controller takes over from there
+				if (audio_only_mode) changed = true;
+				audio_only_mode = false;
+				abr_enabled = true;
 			} else {
-				int new_p_value = available_qualities[view.selected_button - 1];
+				int new_p_value = available_qualities[view.selected_button - 2];
 				if (audio_only_mode || video_p_value != new_p_value) changed = true;
 				audio_only_mode = false;
+				abr_enabled = false;
 				video_p_value = new_p_value;
 			}
 			if (changed) {
@@ -1105,6 +1129,22 @@ static void decode_thread(void* arg)
 					if (vid_play_request && !vid_seek_request && !vid_change_video_request) {
 						if (result.code != 0)
 							Util_log_save(DEF_SAPP0_DECODE_THREAD_STR, "Util_video_decoder_decode()..." + result.string + result.error_description, result.code);
+						// quality switches are made at keyframes, where the new stream can be started without a visible glitch
+						else if (key && abr_enabled && !cur_video_info.is_livestream && osGetTime() - abr_last_update >= ABR_UPDATE_INTERVAL) {
+							abr_last_update = osGetTime();
+							uint64_t transferred_bytes;
+							SceUInt64 transfer_time;
+							stream_downloader.get_transfer_totals(&transferred_bytes, &transfer_time);
+							abr_controller.add_transfer_totals(transferred_bytes, transfer_time);
+							int new_p_value = abr_controller.select(video_p_value, stream_downloader.get_buffered_seconds(), abr_last_update * 1000);
+							if (new_p_value != video_p_value) {
+								Util_log_save(DEF_SAPP0_DECODE_THREAD_STR, "abr : " + std::to_string(video_p_value) + "p -> " + std::to_string(new_p_value) + "p");
+								video_p_value = new_p_value;
+								seek_at_init_request = pos;
+								vid_change_video_request = true;
+								network_decoder.interrupt = true;
+							}
+						}
 					}
 				} else if (type == NetworkMultipleDecoder::DecodeType::INTERRUPTED) continue;
 				else Util_log_save(DEF_SAPP0_DECODE_THREAD_STR, "unknown type of packet");
@@ -1144,6 +1184,9 @@ static void convert_thread(void* arg)
 	Util_log_save(DEF_SAPP0_CONVERT_THREAD_STR, "Thread started.");
 	u8* yuv_video = NULL;
 	u8* video = NULL;
+	// output of the software decoder path, reallocated only when a larger stream comes (the texture upload is done before the next conversion)
+	u8* frame_buffer = NULL;
+	int frame_buffer_size = 0;
 	TickCounter counter0, counter1;
 	Result_with_string result;
 
@@ -1184,13 +1227,23 @@ static void convert_thread(void* arg)
 					break;
 				}
 				
-				bool video_need_free = false;
 				vid_copy_time[0] = osTickCounterRead(&counter0);
 				
 				osTickCounterUpdate(&counter0);
 				if (!network_decoder.hw_decoder_enabled) {
-					result = Util_converter_y2r_yuv420p_to_bgr565(yuv_video, &video, vid_width, vid_height, false);
-					video_need_free = true;
+					if (frame_buffer_size < vid_width * vid_height * 2) {
+						free(frame_buffer);
+						frame_buffer_size = vid_width * vid_height * 2;
+						frame_buffer = (u8*)malloc(frame_buffer_size);
+						if (!frame_buffer) frame_buffer_size = 0;
+					}
+					if (frame_buffer) {
+						video = frame_buffer;
+						result = Util_converter_y2r_yuv420p_to_bgr565_buffer(yuv_video, video, vid_width, vid_height, false);
+					} else {
+						result.code = DEF_ERR_OUT_OF_MEMORY;
+						result.string = DEF_ERR_OUT_OF_MEMORY_STR;
+					}
 				}
 				osTickCounterUpdate(&counter0);
 				vid_convert_time = osTickCounterRead(&counter0);
@@ -1288,8 +1341,7 @@ static void convert_thread(void* arg)
 				else
 					Util_log_save(DEF_SAPP0_CONVERT_THREAD_STR, "Util_converter_yuv420p_to_bgr565()..." + result.string + result.error_description, result.code);
 
-				if (video_need_free) free(video);
-				video = NULL;
+				video = NULL; // either frame_buffer or the decoder's buffer, neither is freed here
 				yuv_video = NULL; // this is the result of network_decoder.get_decoded_video_frame(), so it should not be freed
 				
 				osTickCounterUpdate(&counter1);
@@ -1306,6 +1358,8 @@ static void convert_thread(void* arg)
 	}
 	
 	y2rExit();
+	free(frame_buffer);
+	frame_buffer = NULL;
 	
 	Util_log_save(DEF_SAPP0_CONVERT_THREAD_STR, "Thread exit.");
 	threadExit(0);
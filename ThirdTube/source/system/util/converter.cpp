@@ -297,8 +297,6 @@ Result_with_string Util_converter_bgr888_to_yuv420p(u8* bgr888, u8** yuv420p, in
 
 Result_with_string Util_converter_y2r_yuv420p_to_bgr565(u8* yuv420p, u8** bgr565, int width, int height, bool texture_format)
 {
-	bool finished = false;
-	Y2RU_ConversionParams y2r_parameters;
 	Result_with_string result;
 
 	*bgr565 = (u8*)malloc(width * height * 2);
@@ -309,6 +307,21 @@ Result_with_string Util_converter_y2r_yuv420p_to_bgr565(u8* yuv420p, u8** bgr565
 		return result;
 	}
 
+	result = Util_converter_y2r_yuv420p_to_bgr565_buffer(yuv420p, *bgr565, width, height, texture_format);
+	if(result.code != 0)
+	{
+		free(*bgr565);
+		*bgr565 = NULL;
+	}
+	return result;
+}
+
+Result_with_string Util_converter_y2r_yuv420p_to_bgr565_buffer(u8* yuv420p, u8* bgr565, int width, int height, bool texture_format)
+{
+	bool finished = false;
+	Y2RU_ConversionParams y2r_parameters;
+	Result_with_string result;
+
 	y2r_parameters.input_format = INPUT_YUV420_INDIV_8;
 	y2r_parameters.output_format = OUTPUT_RGB_16_565;
 	y2r_parameters.rotation = ROTATION_NONE;
@@ -349,7 +362,7 @@ Result_with_string Util_converter_y2r_yuv420p_to_bgr565(u8* yuv420p, u8** bgr565
 		return result;
 	}
 
-	result.code = Y2RU_SetReceiving(*bgr565, width * height * 2, width * 2 * 4, 0);
+	result.code = Y2RU_SetReceiving(bgr565, width * height * 2, width * 2 * 4, 0);
 	if(result.code != 0)
 	{
 		result.string = "[Error] Y2RU_SetReceiving() failed. ";
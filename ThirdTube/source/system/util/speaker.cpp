@@ -1,7 +1,30 @@
 #include "headers.hpp"
 
-ndspWaveBuf util_ndsp_buffer[24][60];
-double util_ndsp_buffer_timestamp[24][60]; // {pts, sample rate}
+#define DEF_SPEAKER_QUEUE_NUM 60
+#define DEF_SPEAKER_SLOT_SAMPLES 2048 // per channel, enough for an AAC/Opus frame after resampling; a slot grows if a frame is larger
+
+ndspWaveBuf util_ndsp_buffer[24][DEF_SPEAKER_QUEUE_NUM];
+double util_ndsp_buffer_timestamp[24][DEF_SPEAKER_QUEUE_NUM]; // {pts, sample rate}
+// the linear memory of the slots is allocated once in Util_speaker_init() and reused until Util_speaker_exit()
+int util_ndsp_buffer_capacity[24][DEF_SPEAKER_QUEUE_NUM];
+
+// guards the slots : Util_speaker_add_buffer() and Util_speaker_clear_buffer() may be called from different threads
+static bool util_speaker_lock_initialized = false;
+static Handle util_speaker_lock;
+
+static void Util_speaker_lock(void)
+{
+	if (!util_speaker_lock_initialized) {
+		svcCreateMutex(&util_speaker_lock, false);
+		util_speaker_lock_initialized = true;
+	}
+	svcWaitSynchronization(util_speaker_lock, std::numeric_limits<s64>::max());
+}
+
+static void Util_speaker_unlock(void)
+{
+	svcReleaseMutex(util_speaker_lock);
+}
 
 void Util_speaker_init(int play_ch, int music_ch, int sample_rate)
 {
@@ -23,9 +46,19 @@ void Util_speaker_init(int play_ch, int music_ch, int sample_rate)
 	
 	ndspChnSetInterp(play_ch, NDSP_INTERP_LINEAR);
 	ndspChnSetRate(play_ch, sample_rate);
+	Util_speaker_lock();
+	// free the slots of a previous Util_speaker_init() that was not followed by Util_speaker_exit()
+	for(int i = 0; i < DEF_SPEAKER_QUEUE_NUM; i++)
+		linearFree_concurrent((void*)util_ndsp_buffer[play_ch][i].data_vaddr);
 	memset(util_ndsp_buffer[play_ch], 0, sizeof(util_ndsp_buffer[play_ch]));
-	for(int i = 0; i < 60; i++)
-		util_ndsp_buffer[play_ch][i].data_vaddr = NULL;
+	for(int i = 0; i < DEF_SPEAKER_QUEUE_NUM; i++)
+	{
+		util_ndsp_buffer_capacity[play_ch][i] = DEF_SPEAKER_SLOT_SAMPLES * 2 * music_ch;
+		util_ndsp_buffer[play_ch][i].data_vaddr = linearAlloc_concurrent(util_ndsp_buffer_capacity[play_ch][i]);
+		if(util_ndsp_buffer[play_ch][i].data_vaddr == NULL)
+			util_ndsp_buffer_capacity[play_ch][i] = 0; // retried in Util_speaker_add_buffer()
+	}
+	Util_speaker_unlock();
 }
 
 Result_with_string Util_speaker_add_buffer(int play_ch, int music_ch, u8* buffer, int size, double pts)
@@ -33,7 +66,8 @@ Result_with_string Util_speaker_add_buffer(int play_ch, int music_ch, u8* buffer
 	Result_with_string result;
 	int free_queue = -1;
 
-	for(int i = 0; i < 60; i++)
+	Util_speaker_lock();
+	for(int i = 0; i < DEF_SPEAKER_QUEUE_NUM; i++)
 	{
 		if(util_ndsp_buffer[play_ch][i].status == NDSP_WBUF_FREE || util_ndsp_buffer[play_ch][i].status == NDSP_WBUF_DONE)
 		{
@@ -44,27 +78,34 @@ Result_with_string Util_speaker_add_buffer(int play_ch, int music_ch, u8* buffer
 
 	if(free_queue == -1)
 	{
+		Util_speaker_unlock();
 		result.code = DEF_ERR_OTHER;
 		result.string = "[Error] Queues are full ";
 		return result;
 	}
 
-	linearFree_concurrent((void*)util_ndsp_buffer[play_ch][free_queue].data_vaddr);
-	util_ndsp_buffer[play_ch][free_queue].data_vaddr = NULL;
-	util_ndsp_buffer[play_ch][free_queue].data_vaddr = (u8*)linearAlloc_concurrent(size * music_ch);
-	if(util_ndsp_buffer[play_ch][free_queue].data_vaddr == NULL)
+	if(util_ndsp_buffer_capacity[play_ch][free_queue] < size * music_ch)
 	{
-		result.code = DEF_ERR_OUT_OF_LINEAR_MEMORY;
-		result.string = DEF_ERR_OUT_OF_LINEAR_MEMORY_STR;
-		return result;
+		linearFree_concurrent((void*)util_ndsp_buffer[play_ch][free_queue].data_vaddr);
+		util_ndsp_buffer_capacity[play_ch][free_queue] = 0;
+		util_ndsp_buffer[play_ch][free_queue].data_vaddr = linearAlloc_concurrent(size * music_ch);
+		if(util_ndsp_buffer[play_ch][free_queue].data_vaddr == NULL)
+		{
+			Util_speaker_unlock();
+			result.code = DEF_ERR_OUT_OF_LINEAR_MEMORY;
+			result.string = DEF_ERR_OUT_OF_LINEAR_MEMORY_STR;
+			return result;
+		}
+		util_ndsp_buffer_capacity[play_ch][free_queue] = size * music_ch;
 	}
 
 	memcpy((void*)util_ndsp_buffer[play_ch][free_queue].data_vaddr, buffer, size * music_ch);
+	DSP_FlushDataCache(util_ndsp_buffer[play_ch][free_queue].data_vaddr, size * music_ch);
 
 	util_ndsp_buffer[play_ch][free_queue].nsamples = size / 2;
-	ndspChnWaveBufAdd(play_ch, &util_ndsp_buffer[play_ch][free_queue]);
-	
 	util_ndsp_buffer_timestamp[play_ch][free_queue] = pts;
+	ndspChnWaveBufAdd(play_ch, &util_ndsp_buffer[play_ch][free_queue]);
+	Util_speaker_unlock();
 	return result;
 }
 
@@ -72,7 +113,7 @@ double Util_speaker_get_current_timestamp(int play_ch, int sample_rate)
 {
 	if (!Util_speaker_is_playing(play_ch)) return -1;
 	double queued_min = INFINITY;
-	for (int i = 0; i < 60; i++) {
+	for (int i = 0; i < DEF_SPEAKER_QUEUE_NUM; i++) {
 		if (util_ndsp_buffer[play_ch][i].status == NDSP_WBUF_PLAYING)
 			return util_ndsp_buffer_timestamp[play_ch][i] + (double) ndspChnGetSamplePos(play_ch) / sample_rate;
 		if (util_ndsp_buffer[play_ch][i].status == NDSP_WBUF_QUEUED)
@@ -88,12 +129,14 @@ double Util_speaker_get_current_timestamp(int play_ch, int sample_rate)
 
 void Util_speaker_clear_buffer(int play_ch)
 {
+	Util_speaker_lock();
 	ndspChnWaveBufClear(play_ch);
 	while (Util_speaker_is_playing(play_ch)) usleep(10000);
-	for (int i = 0; i < 60; i++) {
+	for (int i = 0; i < DEF_SPEAKER_QUEUE_NUM; i++) {
 		util_ndsp_buffer[play_ch][i].status = NDSP_WBUF_FREE;
 		util_ndsp_buffer_timestamp[play_ch][i] = 0.0;
 	}
+	Util_speaker_unlock();
 }
 
 void Util_speaker_pause(int play_ch)
@@ -118,11 +161,14 @@ bool Util_speaker_is_playing(int play_ch)
 
 void Util_speaker_exit(int play_ch)
 {
+	Util_speaker_lock();
 	ndspChnWaveBufClear(play_ch);
 	ndspChnSetPaused(play_ch, false);
-	for(int i = 0; i < 60; i++)
+	for(int i = 0; i < DEF_SPEAKER_QUEUE_NUM; i++)
 	{
 		linearFree_concurrent((void*)util_ndsp_buffer[play_ch][i].data_vaddr);
 		util_ndsp_buffer[play_ch][i].data_vaddr = NULL;
+		util_ndsp_buffer_capacity[play_ch][i] = 0;
 	}
+	Util_speaker_unlock();
 }
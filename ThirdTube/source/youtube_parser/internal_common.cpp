@@ -54,11 +54,10 @@ namespace youtube_parser {
 		if (!header.count("Accept-Language")) header["Accept-Language"] = language_code + ";q=0.9";
 		
 		debug("accessing...");
-		auto result = Access_http_get(url, header);
-		if (result.fail) debug("fail : " + result.error);
+		auto result = Access_http_get_shared(url, header);
+		if (result->fail) debug("fail : " + result->error);
 		else debug("ok");
-		result.finalize();
-		return std::string(result.data.begin(), result.data.end());
+		return std::string(result->data.begin(), result->data.end());
 	}
 	std::string http_post_json(const std::string &url, const std::string &json) {
 		debug("accessing(POST)...");
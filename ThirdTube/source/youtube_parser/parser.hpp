@@ -2,6 +2,8 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
+#include <cstdint>
 
 #ifdef TT_PRX
 #define PRX_EXPORT __declspec(dllexport)
@@ -100,6 +102,21 @@ struct YouTubeVideoDetail {
 	std::string audio_stream_url;
 	std::map<int, std::string> video_stream_urls; // first : video size (144p, 240p, 360p ...)
 	std::string both_stream_url;
+	// what the player format list says about each of the streams above, so that they can be opened without probing
+	struct StreamFormat {
+		int itag = -1;
+		std::string mime_type; // e.g. "video/mp4"
+		std::string codecs; // e.g. "avc1.4d401e"
+		int bitrate = 0; // bits per second
+		uint64_t content_length = 0; // 0 if unknown
+		// inclusive byte ranges of the initialization data and of the segment index ('sidx' or Cues), {0, 0} if unknown
+		std::pair<uint64_t, uint64_t> init_range;
+		std::pair<uint64_t, uint64_t> index_range;
+		
+		// the bytes at the beginning of the stream needed to start playback without probing, 0 if unknown
+		uint64_t get_header_size() const { return std::max(init_range.second, index_range.second) ? std::max(init_range.second, index_range.second) + 1 : 0; }
+	};
+	std::map<std::string, StreamFormat> stream_formats; // key : stream url
 	int duration_ms;
 	bool is_livestream;
 	enum class LivestreamType {
@@ -222,6 +239,57 @@ PRX_EXPORT bool is_youtube_url(const char *url);
 PRX_EXPORT bool is_youtube_thumbnail_url(const char *url);
 PRX_EXPORT YouTubePageType youtube_get_page_type(const char *url);
 
+// network record/replay
+// capture writes every request and response to `path`, replay answers requests from such a file without accessing the network
+PRX_EXPORT bool network_capture_start(const char *path);
+PRX_EXPORT bool network_replay_start(const char *path, bool original_timing);
+PRX_EXPORT void network_capture_stop();
+
+// network statistics (per-endpoint request counts, bytes and latency histograms of each request phase)
+PRX_EXPORT void network_stats_reset();
+PRX_EXPORT bool network_stats_dump(const char *path);
+PRX_EXPORT void network_stats_get_text(char *text, int textLen);
+
+// http response cache (ETag/Last-Modified/Cache-Control aware, kept in memory and optionally under savedata0:yt_http_cache/)
+// quotas are in bytes, 0 disables the corresponding tier; by default only the memory tier is on
+PRX_EXPORT void network_cache_set_quota(unsigned int memory_quota, unsigned int disk_quota);
+PRX_EXPORT void network_cache_clear();
+
+// network scheduler : while set, requests other than media playback stop reading so that the player can refill its buffer
+PRX_EXPORT void network_scheduler_set_playback_critical(bool critical);
+
+// media prefetch : the first block of the streams the player is likely to open is requested as soon as their urls are parsed
+// `p_value` is the video quality the player is going to select, 0 for audio only, -1 disables the prefetch
+PRX_EXPORT void youtube_set_stream_prefetch_quality(int p_value);
+
+// offline downloads (saved under ux0:data/ThirdTube/downloads/, played back from there by the stream downloader once complete)
+// `audio_url` may be NULL for a muxed stream; starting a download of the same streams again resumes it
+PRX_EXPORT int network_download_start(const char *video_url, const char *audio_url);
+PRX_EXPORT void network_download_pause(int id);
+PRX_EXPORT void network_download_cancel(int id);
+// state : 0 queued, 1 downloading, 2 paused, 3 done, 4 error
+PRX_EXPORT bool network_download_get_progress(int id, unsigned long long *downloaded, unsigned long long *total, int *state);
+PRX_EXPORT void network_download_set_rate_limit(unsigned int bytes_per_second);
+
+// disk tier for media blocks evicted from memory (off until a non-zero quota in bytes is set)
+PRX_EXPORT void network_spill_set_path(const char *path);
+PRX_EXPORT void network_spill_set_quota(unsigned int quota);
+PRX_EXPORT void network_spill_remove_group(const char *group);
+PRX_EXPORT void network_spill_clear();
+PRX_EXPORT void network_spill_get_stats(unsigned int *hit_count, unsigned int *miss_count);
+
+// livestream playback : `video_url`/`audio_url` are the fragment urls without the sequence number (`audio_url` may be NULL for a muxed stream)
+// read with url_index 0 for the video and 1 for the audio, like a single file each; returns the id of the livestream, -1 on failure
+PRX_EXPORT int network_livestream_open(const char *video_url, const char *audio_url, double fragment_len, int first_seq);
+PRX_EXPORT void network_livestream_close(int id);
+PRX_EXPORT int network_livestream_read(int id, int url_index, unsigned char *buf, int buf_size);
+PRX_EXPORT bool network_livestream_seek(int id, int seq);
+PRX_EXPORT int network_livestream_get_cur_seq(int id, int url_index);
+PRX_EXPORT int network_livestream_get_seq_head(int id);
+// seeking by time : the fragment that contains `time` (seconds) and the start time of a fragment, -1 if nothing is known yet
+PRX_EXPORT int network_livestream_find(int id, double time);
+PRX_EXPORT double network_livestream_get_start_time(int id, int seq);
+
 #else
 
 struct YouTubeChannelSuccinct {
@@ -293,6 +361,21 @@ struct YouTubeVideoDetail {
 	std::string audio_stream_url;
 	std::map<int, std::string> video_stream_urls; // first : video size (144p, 240p, 360p ...)
 	std::string both_stream_url;
+	// what the player format list says about each of the streams above, so that they can be opened without probing
+	struct StreamFormat {
+		int itag = -1;
+		std::string mime_type; // e.g. "video/mp4"
+		std::string codecs; // e.g. "avc1.4d401e"
+		int bitrate = 0; // bits per second
+		uint64_t content_length = 0; // 0 if unknown
+		// inclusive byte ranges of the initialization data and of the segment index ('sidx' or Cues), {0, 0} if unknown
+		std::pair<uint64_t, uint64_t> init_range;
+		std::pair<uint64_t, uint64_t> index_range;
+		
+		// the bytes at the beginning of the stream needed to start playback without probing, 0 if unknown
+		uint64_t get_header_size() const { return std::max(init_range.second, index_range.second) ? std::max(init_range.second, index_range.second) + 1 : 0; }
+	};
+	std::map<std::string, StreamFormat> stream_formats; // key : stream url
 	int duration_ms;
 	bool is_livestream;
 	enum class LivestreamType {
@@ -1,4 +1,9 @@
 #include "parser.hpp"
+#include "network/network_capture.hpp"
+#include "network/network_stats.hpp"
+#include "network/network_spill.hpp"
+#include "network/network_download.hpp"
+#include "network/network_livestream.hpp"
 #include <stdio.h>
 
 void youtube_destroy_struct(YouTubeChannelDetail *s)
@@ -81,3 +86,58 @@ void youtube_destroy_struct(YouTubeVideoDetail::Comment *s)
 		return youtube_get_page_type(str);
 	}
 
+	bool network_capture_start(const char *path)
+	{
+		std::string str(path);
+		return network_capture_start(str);
+	}
+	bool network_replay_start(const char *path, bool original_timing)
+	{
+		std::string str(path);
+		return network_replay_start(str, original_timing);
+	}
+
+	bool network_stats_dump(const char *path)
+	{
+		std::string str(path);
+		return network_stats_dump(str);
+	}
+	void network_stats_get_text(char *text, int textLen)
+	{
+		if (textLen <= 0) return;
+		std::string res = network_stats_to_string();
+		strncpy(text, res.c_str(), textLen);
+		text[textLen - 1] = '\0';
+	}
+
+	void network_spill_set_path(const char *path)
+	{
+		std::string str(path);
+		network_spill_set_path(str);
+	}
+	void network_spill_remove_group(const char *group)
+	{
+		std::string str(group);
+		network_spill_remove_group(str);
+	}
+
+	int network_download_start(const char *video_url, const char *audio_url)
+	{
+		std::vector<std::string> urls = { video_url };
+		if (audio_url) urls.push_back(audio_url);
+		return network_download_start(urls);
+	}
+	bool network_download_get_progress(int id, unsigned long long *downloaded, unsigned long long *total, int *state)
+	{
+		NetworkDownloadState cur_state;
+		bool res = network_download_get_progress(id, downloaded, total, &cur_state);
+		if (res) *state = (int) cur_state;
+		return res;
+	}
+
+	int network_livestream_open(const char *video_url, const char *audio_url, double fragment_len, int first_seq)
+	{
+		std::vector<std::string> urls = { video_url };
+		if (audio_url) urls.push_back(audio_url);
+		return network_livestream_open(urls, fragment_len, first_seq);
+	}
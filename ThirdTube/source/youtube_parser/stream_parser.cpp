@@ -4,6 +4,9 @@
 #include "cipher.hpp"
 #include "n_param.hpp"
 #include "cache.hpp"
+#include "network/network_downloader.hpp"
+
+static volatile int stream_prefetch_p_value = 360;
 
 static Result_with_string Util_file_load_from_file(std::string file_name, std::string dir_path, uint8_t* read_data, int max_size, uint32_t* read_size)
 {
@@ -270,6 +273,31 @@ static bool extract_stream(YouTubeVideoDetail &res, const std::string &html) {
 			res.both_stream_url = i["url"].string_value();
 		}
 	}
+	// format metadata of the selected streams
+	for (auto i : formats) {
+		std::string cur_url = i["url"].string_value();
+		bool selected = cur_url == res.audio_stream_url || cur_url == res.both_stream_url;
+		for (auto &j : res.video_stream_urls) if (cur_url == j.second) selected = true;
+		if (!selected || cur_url == "") continue;
+		
+		YouTubeVideoDetail::StreamFormat &format = res.stream_formats[cur_url];
+		format.itag = i["itag"].int_value();
+		// "video/mp4; codecs=\"avc1.4d401e\""
+		auto mime_type = i["mimeType"].string_value();
+		format.mime_type = mime_type.substr(0, mime_type.find(';'));
+		auto codecs_pos = mime_type.find("codecs=\"");
+		if (codecs_pos != std::string::npos) {
+			codecs_pos += std::string("codecs=\"").size();
+			format.codecs = mime_type.substr(codecs_pos, mime_type.find('"', codecs_pos) - codecs_pos);
+		}
+		format.bitrate = i["bitrate"].int_value();
+		format.content_length = strtoull(i["contentLength"].string_value().c_str(), NULL, 10);
+		auto get_range = [] (Json range) {
+			return std::make_pair<uint64_t, uint64_t>(strtoull(range["start"].string_value().c_str(), NULL, 10), strtoull(range["end"].string_value().c_str(), NULL, 10));
+		};
+		format.init_range = get_range(i["initRange"]);
+		format.index_range = get_range(i["indexRange"]);
+	}
 	
 	// extract caption data
 	for (auto base_lang : player_response["captions"]["playerCaptionsTracklistRenderer"]["captionTracks"].array_items()) {
@@ -451,6 +479,24 @@ static void extract_metadata(YouTubeVideoDetail &res, const std::string &html) {
 	}
 }
 
+void youtube_set_stream_prefetch_quality(int p_value) { stream_prefetch_p_value = p_value; }
+
+// starts downloading the beginning (the initialization data and the first seconds) of the streams the player will
+// most likely open, so that it overlaps with the rest of the parsing; follows the stream selection of the player
+static void prefetch_streams(const YouTubeVideoDetail &res) {
+	int p_value = stream_prefetch_p_value;
+	if (p_value < 0 || res.is_livestream || !res.is_playable()) return;
+	std::vector<std::string> urls;
+	if (p_value == 0) urls.push_back(res.audio_stream_url);
+	else if (p_value == 360 && res.duration_ms <= 60 * 60 * 1000 && res.both_stream_url != "") urls.push_back(res.both_stream_url);
+	else if (res.video_stream_urls.count(p_value)) {
+		urls.push_back(res.video_stream_urls.at(p_value));
+		urls.push_back(res.audio_stream_url);
+	}
+	for (auto &url : urls) if (url != "")
+		network_stream_prefetch_first_block(url, res.stream_formats.count(url) ? res.stream_formats.at(url).get_header_size() : 0);
+}
+
 YouTubeVideoDetail *youtube_parse_video_page(std::string url) {
 	YouTubeVideoDetail *res = new YouTubeVideoDetail();
 
@@ -464,6 +510,8 @@ YouTubeVideoDetail *youtube_parse_video_page(std::string url) {
 	}
 
 	extract_stream(*res, html);
+	for (auto &format : res->stream_formats) network_stream_set_header_size(format.first, format.second.get_header_size());
+	prefetch_streams(*res);
 	extract_metadata(*res, html);
 	
 	